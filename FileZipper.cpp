@@ -1,11 +1,7 @@
-#include <iostream>
-#include <fstream>
-#include <queue>
-#include <unordered_map>
-#include <string>
-#include <filesystem>
-#include <sstream>
-#include <ctime>
+#include "FileZipperCore.h"
+#include "FileZipperCli.h"
+
+#include <cfloat>
 
 #include <GL/glew.h>
 #include "imgui.h"
@@ -15,239 +11,6 @@
 #include <Windows.h>
 #include <ShObjIdl.h> 
 
-using namespace std;
-namespace fs = std::filesystem;
-
-// Node structure for Huffman tree
-class Node {
-public:
-    char data;
-    unsigned freq;
-    Node* left;
-    Node* right;
-
-    Node(char data, unsigned freq) : data(data), freq(freq), left(NULL), right(NULL) {}
-};
-
-// Comparison function for priority queue
-class Compare {
-public:
-    bool operator()(Node* l, Node* r) {
-        return l->freq > r->freq;
-    }
-};
-
-class HuffmanCoding {
-private:
-    Node* root;
-    unordered_map<char, string> huffmanCode;
-    int bitCount;
-    char byte;
-    string originalFileExtension;
-
-    // Helper function to generate Huffman codes
-    void generateCodes(Node* node, const string& str) {
-        if (!node) return;
-
-        if (node->data != '\0') {
-            huffmanCode[node->data] = str;
-        }
-
-        generateCodes(node->left, str + "0");
-        generateCodes(node->right, str + "1");
-    }
-
-    // Helper function to write bits to file
-    void writeBits(ofstream& outFile, const string& bits) {
-        for (char bit : bits) {
-            byte = (byte << 1) | (bit - '0');
-            bitCount++;
-
-            if (bitCount == 8) {
-                outFile.put(byte);
-                bitCount = 0;
-                byte = 0;
-            }
-        }
-    }
-
-    // Helper function to read bits from file
-    string readBits(ifstream& inFile) {
-        string bits;
-        char byte;
-        while (inFile.get(byte)) {
-            for (int i = 7; i >= 0; --i) {
-                bits += ((byte >> i) & 1) ? '1' : '0';
-            }
-        }
-        return bits;
-    }
-
-    void cleanup(Node* node) {
-        if (node) {
-            cleanup(node->left);
-            cleanup(node->right);
-            delete node;
-        }
-    }
-
-public:
-    HuffmanCoding() : root(NULL), bitCount(0), byte(0) {}
-
-    ~HuffmanCoding() {
-        cleanup(root);
-    }
-
-    // Build Huffman tree from character frequencies
-    void buildTree(const unordered_map<char, int>& frequency) {
-        priority_queue<Node*, vector<Node*>, Compare> pq;
-
-        for (auto& pair : frequency) {
-            pq.push(new Node(pair.first, pair.second));
-        }
-
-        while (pq.size() > 1) {
-            Node* left = pq.top(); pq.pop();
-            Node* right = pq.top(); pq.pop();
-
-            Node* internal = new Node('\0', left->freq + right->freq);
-            internal->left = left;
-            internal->right = right;
-            pq.push(internal);
-        }
-
-        if (!pq.empty()) {
-            root = pq.top();
-        } else {
-            root = NULL;
-        }
-    }
-
-    // Generate Huffman codes
-    void generateHuffmanCodes() {
-        if (root) {
-            generateCodes(root, "");
-        } else {
-            cerr << "Error: Huffman tree is empty. Cannot generate codes.\n";
-        }
-    }
-
-    // Compress a file
-    bool compressFile(const string& inputFile, const string& outputFile) {
-        try {
-            // Store original file extension
-            fs::path inputPath(inputFile);
-            originalFileExtension = inputPath.extension().string();
-            
-            ifstream inFile(inputFile, ios::binary);
-            ofstream outFile(outputFile, ios::binary);
-
-            // Write file extension to header
-            size_t extLen = originalFileExtension.length();
-            outFile.write(reinterpret_cast<const char*>(&extLen), sizeof(extLen));
-            outFile.write(originalFileExtension.c_str(), extLen);
-
-            // First, calculate frequencies
-            unordered_map<char, int> frequency;
-            char ch;
-            while (inFile.get(ch)) {
-                frequency[ch]++;
-            }
-            inFile.clear();
-            inFile.seekg(0);
-
-            // Write frequency table size
-            size_t freqSize = frequency.size();
-            outFile.write(reinterpret_cast<const char*>(&freqSize), sizeof(freqSize));
-
-            // Write frequency table
-            for (const auto& pair : frequency) {
-                outFile.write(&pair.first, sizeof(char));
-                outFile.write(reinterpret_cast<const char*>(&pair.second), sizeof(int));
-            }
-
-            buildTree(frequency);
-            generateHuffmanCodes();
-
-            // Write compressed data
-            while (inFile.get(ch)) {
-                if (huffmanCode.find(ch) == huffmanCode.end()) {
-                    return false;
-                }
-                string code = huffmanCode[ch];
-                writeBits(outFile, code);
-            }
-
-            // Write remaining bits
-            if (bitCount > 0) {
-                byte <<= (8 - bitCount);
-                outFile.put(byte);
-            }
-
-            inFile.close();
-            outFile.close();
-            return true;
-        }
-        catch (const std::exception& e) {
-            cerr << "Compression error: " << e.what() << endl;
-            return false;
-        }
-    }
-
-    // Decompress a file
-    bool decompressFile(const string& inputFile, const string& outputFile) {
-        try {
-            ifstream inFile(inputFile, ios::binary);
-            ofstream outFile(outputFile);
-
-            // Read frequency table
-            size_t freqSize;
-            inFile.read(reinterpret_cast<char*>(&freqSize), sizeof(freqSize));
-
-            unordered_map<char, int> frequency;
-            for (size_t i = 0; i < freqSize; i++) {
-                char ch;
-                int freq;
-                inFile.read(&ch, sizeof(char));
-                inFile.read(reinterpret_cast<char*>(&freq), sizeof(int));
-                frequency[ch] = freq;
-            }
-
-            // Rebuild Huffman tree
-            buildTree(frequency);
-            generateHuffmanCodes();
-
-            // Read compressed data
-            string bits = readBits(inFile);
-            Node* current = root;
-            
-            for (char bit : bits) {
-                if (!current) break;
-                
-                current = (bit == '0') ? current->left : current->right;
-
-                if (current && current->data != '\0') {
-                    outFile.put(current->data);
-                    current = root;
-                }
-            }
-
-            inFile.close();
-            outFile.close();
-            return true;
-        }
-        catch (const std::exception& e) {
-            cerr << "Decompression error: " << e.what() << endl;
-            return false;
-        }
-    }
-
-    // Get the Huffman codes
-    const unordered_map<char, string>& getHuffmanCodes() const {
-        return huffmanCode;
-    }
-};
-
 // File dialog helper function
 string openFileDialog(bool save = false) {
     string filename;
@@ -283,35 +46,19 @@ string openFileDialog(bool save = false) {
     return filename;
 }
 
-// Add this structure after existing classes
-struct FileRecord {
-    string originalPath;
-    string compressedPath;
-    string decompressPath;
-    string fileType;
-    time_t timestamp;
-};
-
 class FileTracker {
 private:
-    const string logFile = "compression_history.txt";
-    
-    string getCurrentTimestamp() {
-        time_t now = time(nullptr);
-        char buffer[26];
-        ctime_s(buffer, sizeof(buffer), &now);
-        string timestamp(buffer);
-        return timestamp.substr(0, timestamp.length() - 1); // Remove newline
-    }
+    const string historyFile = "compression_history.fzh";
+    HistoryStore history;
 
 public:
-    void saveRecord(const FileRecord& record) {
-        ofstream out(logFile, ios::app);
-        out << "Original: " << record.originalPath << "\n"
-            << "Compressed: " << record.compressedPath << "\n"
-            << "Decompress: " << record.decompressPath << "\n"
-            << "Type: " << record.fileType << "\n"
-            << "Time: " << getCurrentTimestamp() << "\n\n";
+    FileTracker() {
+        history.open(historyFile);
+    }
+
+    // Jobs record themselves here, and compress jobs skip unchanged inputs
+    HistoryStore& getHistory() {
+        return history;
     }
 
     string generateCompressedPath(const string& inputPath) {
@@ -327,12 +74,20 @@ public:
         // Read original extension from compressed file header
         ifstream in(inputPath, ios::binary);
         if (in) {
-            size_t extLen;
-            in.read(reinterpret_cast<char*>(&extLen), sizeof(extLen));
-            if (extLen < 10) { // Sanity check
-                string ext(extLen, '\0');
-                in.read(&ext[0], extLen);
+            string ext;
+            if (BlockCoder::readStreamHeader(in, ext)) {
                 originalExt = ext;
+            } else {
+                // Older single-table format
+                in.clear();
+                in.seekg(0);
+                size_t extLen;
+                in.read(reinterpret_cast<char*>(&extLen), sizeof(extLen));
+                if (extLen < 10) { // Sanity check
+                    ext.assign(extLen, '\0');
+                    in.read(&ext[0], extLen);
+                    originalExt = ext;
+                }
             }
             in.close();
         }
@@ -360,13 +115,18 @@ void guiMenu() {
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init("#version 130");
 
-    HuffmanCoding huffman;
+    // The tracker owns the history store, so it must outlive the job queue
     FileTracker fileTracker;
+    JobQueue jobs;
+    jobs.setHistory(&fileTracker.getHistory());
+    vector<int> activeJobs;
     char inputPath[256] = "";
     char outputPath[256] = "";
     bool showSuccess = false;
     string statusMessage;
     bool showError = false;
+    RunStats lastStats;
+    bool haveStats = false;
 
     while (!glfwWindowShouldClose(window)) {
         glfwPollEvents();
@@ -404,22 +164,9 @@ void guiMenu() {
             if (strlen(inputPath) > 0) {
                 if (fs::exists(inputPath)) {
                     string compressedPath = fileTracker.generateCompressedPath(inputPath);
-                    if (huffman.compressFile(inputPath, compressedPath)) {
-                        FileRecord record;
-                        record.originalPath = inputPath;
-                        record.compressedPath = compressedPath;
-                        record.fileType = fs::path(inputPath).extension().string();
-                        fileTracker.saveRecord(record);
-                        
-                        showSuccess = true;
-                        showError = false;
-                        statusMessage = "File compressed successfully to: " + compressedPath;
-                        strncpy(outputPath, compressedPath.c_str(), sizeof(outputPath) - 1);
-                    } else {
-                        showError = true;
-                        showSuccess = false;
-                        statusMessage = "Compression failed!";
-                    }
+                    activeJobs.push_back(jobs.submit(JOB_COMPRESS, inputPath, compressedPath));
+                    showSuccess = false;
+                    showError = false;
                 } else {
                     showError = true;
                     statusMessage = "Input file does not exist!";
@@ -435,21 +182,9 @@ void guiMenu() {
             if (strlen(inputPath) > 0) {
                 if (fs::exists(inputPath)) {
                     string decompressPath = fileTracker.generateDecompressPath(inputPath);
-                    if (huffman.decompressFile(inputPath, decompressPath)) {
-                        FileRecord record;
-                        record.compressedPath = inputPath;
-                        record.decompressPath = decompressPath;
-                        fileTracker.saveRecord(record);
-                        
-                        showSuccess = true;
-                        showError = false;
-                        statusMessage = "File decompressed successfully to: " + decompressPath;
-                        strncpy(outputPath, decompressPath.c_str(), sizeof(outputPath) - 1);
-                    } else {
-                        showError = true;
-                        showSuccess = false;
-                        statusMessage = "Decompression failed!";
-                    }
+                    activeJobs.push_back(jobs.submit(JOB_DECOMPRESS, inputPath, decompressPath));
+                    showSuccess = false;
+                    showError = false;
                 } else {
                     showError = true;
                     statusMessage = "Input file does not exist!";
@@ -460,6 +195,86 @@ void guiMenu() {
             }
         }
 
+        ImGui::SameLine();
+        if (ImGui::Button("Verify", ImVec2(120, 0))) {
+            if (strlen(inputPath) > 0) {
+                if (fs::exists(inputPath)) {
+                    activeJobs.push_back(jobs.submit(JOB_VERIFY, inputPath, ""));
+                    showSuccess = false;
+                    showError = false;
+                } else {
+                    showError = true;
+                    statusMessage = "Input file does not exist!";
+                }
+            } else {
+                showError = true;
+                statusMessage = "Please select input file!";
+            }
+        }
+
+        // Poll queued and running jobs: draw progress, and record the ones that finished
+        for (size_t i = 0; i < activeJobs.size();) {
+            JobStatus status;
+            if (!jobs.getStatus(activeJobs[i], status)) {
+                activeJobs.erase(activeJobs.begin() + i);
+                continue;
+            }
+            bool compressing = (status.type == JOB_COMPRESS);
+            bool verifying = (status.type == JOB_VERIFY || status.type == JOB_VERIFY_FULL);
+            if (status.finished()) {
+                if (status.state == JOB_DONE && !status.reused) {
+                    haveStats = jobs.getStats(status.id, lastStats);
+                }
+                if (verifying) {
+                    showSuccess = (status.state == JOB_DONE);
+                    showError = !showSuccess;
+                    statusMessage = status.state == JOB_DONE ? "Checksums match: " + status.input
+                        : status.state == JOB_CANCELLED ? "Verification cancelled."
+                        : "Verification failed: " + status.input + " is damaged!";
+                } else if (status.state == JOB_DONE) {
+                    showSuccess = true;
+                    showError = false;
+                    statusMessage = status.reused
+                        ? "Unchanged since last compressed, kept: " + status.output
+                        : string(compressing ? "File compressed" : "File decompressed") +
+                            " successfully to: " + status.output;
+                    strncpy(outputPath, status.output.c_str(), sizeof(outputPath) - 1);
+                } else {
+                    showError = true;
+                    showSuccess = false;
+                    statusMessage = status.state == JOB_CANCELLED
+                        ? (compressing ? "Compression cancelled." : "Decompression cancelled.")
+                        : (compressing ? "Compression failed!" : "Decompression failed!");
+                }
+                activeJobs.erase(activeJobs.begin() + i);
+                continue;
+            }
+
+            char overlay[128];
+            if (status.state == JOB_QUEUED) {
+                snprintf(overlay, sizeof(overlay), "Queued");
+            } else if (status.etaSeconds >= 0.0) {
+                snprintf(overlay, sizeof(overlay), "%.1f / %.1f MB  %.1f MB/s  ETA %.0f s",
+                         status.bytesIn / 1048576.0, status.totalBytes / 1048576.0, status.mbps,
+                         status.etaSeconds);
+            } else {
+                snprintf(overlay, sizeof(overlay), "%.1f / %.1f MB",
+                         status.bytesIn / 1048576.0, status.totalBytes / 1048576.0);
+            }
+            float fraction = status.totalBytes ? float(double(status.bytesIn) / status.totalBytes) : 0.0f;
+
+            ImGui::PushID(status.id);
+            ImGui::Text("%s %s", verifying ? "Verifying" : compressing ? "Compressing" : "Decompressing",
+                        fs::path(status.input).filename().string().c_str());
+            ImGui::ProgressBar(min(fraction, 1.0f), ImVec2(-80, 0), overlay);
+            ImGui::SameLine();
+            if (ImGui::Button("Cancel")) {
+                jobs.cancel(status.id);
+            }
+            ImGui::PopID();
+            i++;
+        }
+
         if (showSuccess || showError) {
             ImGui::TextColored(
                 showSuccess ? ImVec4(0.0f, 1.0f, 0.0f, 1.0f) : ImVec4(1.0f, 0.0f, 0.0f, 1.0f),
@@ -467,6 +282,52 @@ void guiMenu() {
             );
         }
 
+        // Where the last finished job spent its time
+        if (haveStats && ImGui::CollapsingHeader("Run statistics")) {
+            if (!STATS_ENABLED) {
+                ImGui::Text("Statistics were compiled out (FILEZIPPER_STATS=OFF).");
+            } else {
+                ImGui::Text("%.2f s on %d threads, %.1f MB in, %.1f MB out: %s-bound",
+                            lastStats.wallSeconds, lastStats.threads, lastStats.bytesIn / 1048576.0,
+                            lastStats.bytesOut / 1048576.0, lastStats.bottleneck());
+                if (ImGui::BeginTable("stages", 5, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+                    ImGui::TableSetupColumn("Stage");
+                    ImGui::TableSetupColumn("Wall ms");
+                    ImGui::TableSetupColumn("CPU ms");
+                    ImGui::TableSetupColumn("MB");
+                    ImGui::TableSetupColumn("MB/s");
+                    ImGui::TableHeadersRow();
+                    for (int i = 0; i < STAGE_COUNT; i++) {
+                        const StageCounter& stage = lastStats.stages.stages[i];
+                        if (stage.calls == 0) {
+                            continue;
+                        }
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        ImGui::TextUnformatted(STAGE_NAMES[i]);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.1f", stage.wallSeconds * 1000.0);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.1f", stage.cpuSeconds * 1000.0);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.1f", stage.bytes / 1048576.0);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.0f", stage.wallSeconds > 0.0 ? stage.bytes / 1048576.0 / stage.wallSeconds : 0.0);
+                    }
+                    ImGui::EndTable();
+                }
+
+                vector<float> ratios;
+                for (const BlockStat& block : lastStats.blocks) {
+                    ratios.push_back(block.bodySize ? float(block.rawSize) / block.bodySize : 0.0f);
+                }
+                if (!ratios.empty()) {
+                    ImGui::PlotHistogram("Block ratio", ratios.data(), int(ratios.size()), 0, NULL, 0.0f,
+                                         FLT_MAX, ImVec2(0, 60));
+                }
+            }
+        }
+
         ImGui::End();
 
         ImGui::Render();
@@ -487,7 +348,11 @@ void guiMenu() {
     glfwTerminate();
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        return runCommandLine(argc, argv);
+    }
+
     guiMenu();
     return 0;
 }
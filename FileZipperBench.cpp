@@ -0,0 +1,358 @@
+// Compression benchmark over a built-in synthetic corpus. Prints JSON with
+// throughput, ratio, peak RSS and per-size latency percentiles, so results
+// can be tracked between releases.
+#include "FileZipperCore.h"
+
+#include <cctype>
+#include <cstdio>
+#include <iomanip>
+#include <random>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Read-only stream over a buffer, so inputs are not copied inside the timed region
+class MemoryStreamBuf : public streambuf {
+public:
+    MemoryStreamBuf(const unsigned char* data, size_t size) {
+        char* begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+        setg(begin, begin, begin + size);
+    }
+};
+
+// Peak resident set size of this process in KiB
+uint64_t peakRssKb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize / 1024;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss) / 1024;
+#else
+    return uint64_t(usage.ru_maxrss);
+#endif
+#endif
+}
+
+// Corpus generators. All use a fixed seed so every run sees the same bytes.
+
+// English-like text: words drawn with a Zipf-like skew, wrapped into lines
+vector<unsigned char> makeText(size_t size, mt19937_64& rng) {
+    static const char* words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be",
+        "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have",
+        "an", "had", "they", "you", "were", "their", "one", "all", "we", "can", "her", "has",
+        "there", "been", "if", "more", "when", "will", "would", "who", "so", "no", "file",
+        "compression", "block", "stream", "archive", "system", "between", "through", "after",
+        "before", "under", "small", "large", "number", "people", "water", "history", "country",
+        "government", "important", "example", "information", "development", "different"
+    };
+    const size_t wordCount = sizeof(words) / sizeof(words[0]);
+    vector<double> weights(wordCount);
+    for (size_t i = 0; i < wordCount; i++) {
+        weights[i] = 1.0 / double(i + 1);
+    }
+    discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    uniform_int_distribution<int> sentence(6, 18);
+
+    string text;
+    text.reserve(size + 128);
+    size_t lineStart = 0;
+    while (text.size() < size) {
+        int length = sentence(rng);
+        for (int i = 0; i < length; i++) {
+            string word = words[pick(rng)];
+            if (i == 0) word[0] = char(toupper(word[0]));
+            text += word;
+            text += (i + 1 == length) ? ". " : " ";
+            if (text.size() - lineStart > 72) {
+                text.back() = '\n';
+                lineStart = text.size();
+            }
+        }
+    }
+    text.resize(size);
+    return vector<unsigned char>(text.begin(), text.end());
+}
+
+// Server log lines: timestamps, levels, request paths, status codes and latencies
+vector<unsigned char> makeLogs(size_t size, mt19937_64& rng) {
+    static const char* levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char* methods[] = { "GET", "GET", "GET", "POST", "PUT", "DELETE" };
+    static const char* paths[] = {
+        "/api/v1/users", "/api/v1/orders", "/api/v1/items", "/health", "/static/app.js", "/login"
+    };
+    static const int statuses[] = { 200, 200, 200, 200, 201, 204, 304, 404, 500 };
+    uniform_int_distribution<int> any(0, 1 << 30);
+    exponential_distribution<double> latency(1.0 / 25.0);
+
+    string logs;
+    logs.reserve(size + 256);
+    uint64_t millis = 1714564800000ull;
+    char line[256];
+    while (logs.size() < size) {
+        millis += uint64_t(any(rng) % 40);
+        time_t seconds = time_t(millis / 1000);
+        struct tm parts = *gmtime(&seconds);
+        int length = snprintf(line, sizeof(line),
+            "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ %-5s [worker-%d] %s %s/%d %d %.1fms 10.0.%d.%d\n",
+            parts.tm_year + 1900, parts.tm_mon + 1, parts.tm_mday, parts.tm_hour, parts.tm_min, parts.tm_sec,
+            int(millis % 1000), levels[any(rng) % 6], any(rng) % 8, methods[any(rng) % 6], paths[any(rng) % 6],
+            any(rng) % 100000, statuses[any(rng) % 9], latency(rng), any(rng) % 16, any(rng) % 256);
+        logs.append(line, size_t(max(length, 0)));
+    }
+    logs.resize(size);
+    return vector<unsigned char>(logs.begin(), logs.end());
+}
+
+// Uniform random bytes, standing in for already-compressed input
+vector<unsigned char> makeRandom(size_t size, mt19937_64& rng) {
+    vector<unsigned char> data(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (unsigned char)rng();
+    }
+    return data;
+}
+
+// Geometrically distributed bytes: a few values dominate, as in sparse or delta-coded data
+vector<unsigned char> makeSkewed(size_t size, mt19937_64& rng) {
+    geometric_distribution<int> value(0.3);
+    vector<unsigned char> data(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (unsigned char)min(value(rng), 255);
+    }
+    return data;
+}
+
+struct Timing {
+    double compressSeconds;
+    double decompressSeconds;
+    size_t compressedSize;
+    bool verified;
+};
+
+double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Compress and decompress one buffer through the block stream format
+template <typename Coder>
+Timing runOnce(Coder& coder, const vector<unsigned char>& data) {
+    Timing timing;
+    MemoryStreamBuf inputBuf(data.data(), data.size());
+    istream input(&inputBuf);
+    ostringstream compressed;
+    auto start = chrono::steady_clock::now();
+    bool ok = coder.compressStream(input, compressed, ".bin");
+    timing.compressSeconds = secondsSince(start);
+
+    string packed = compressed.str();
+    timing.compressedSize = packed.size();
+    MemoryStreamBuf packedBuf(reinterpret_cast<const unsigned char*>(packed.data()), packed.size());
+    istream packedInput(&packedBuf);
+    ostringstream restored;
+    start = chrono::steady_clock::now();
+    ok = coder.decompressStream(packedInput, restored) && ok;
+    timing.decompressSeconds = secondsSince(start);
+
+    string output = restored.str();
+    timing.verified = ok && output.size() == data.size() &&
+                      memcmp(output.data(), data.data(), data.size()) == 0;
+    return timing;
+}
+
+// Compress and decompress one buffer in memory with preallocated output, as a
+// request handler embedding the codec would
+Timing runBuffer(BlockCoder& coder, const vector<unsigned char>& data, vector<unsigned char>& packed,
+                 vector<unsigned char>& restored) {
+    Timing timing;
+    packed.resize(BlockCoder::compressBound(data.size(), coder.getBlockSize()));
+    restored.resize(data.size());
+    size_t packedSize = 0;
+    size_t restoredSize = 0;
+    auto start = chrono::steady_clock::now();
+    bool ok = coder.compressBuffer(data.data(), data.size(), packed.data(), packed.size(), packedSize);
+    timing.compressSeconds = secondsSince(start);
+    timing.compressedSize = packedSize;
+
+    start = chrono::steady_clock::now();
+    ok = coder.decompressBuffer(packed.data(), packedSize, restored.data(), restored.size(), restoredSize) && ok;
+    timing.decompressSeconds = secondsSince(start);
+
+    timing.verified = ok && restoredSize == data.size() &&
+                      memcmp(restored.data(), data.data(), data.size()) == 0;
+    return timing;
+}
+
+// Value at fraction q of sorted samples, in microseconds
+double percentile(const vector<double>& sorted, double q) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = size_t(q * double(sorted.size() - 1) + 0.5);
+    return sorted[min(index, sorted.size() - 1)] * 1e6;
+}
+
+string percentileJson(vector<double> samples) {
+    sort(samples.begin(), samples.end());
+    ostringstream json;
+    json << fixed << setprecision(1)
+         << "{\"p50\": " << percentile(samples, 0.50) << ", \"p90\": " << percentile(samples, 0.90)
+         << ", \"p99\": " << percentile(samples, 0.99) << ", \"max\": " << percentile(samples, 1.0) << "}";
+    return json.str();
+}
+
+// Parse a comma-separated list of levels such as 0,1,5
+bool parseLevels(const string& text, vector<int>& levels) {
+    levels.clear();
+    stringstream list(text);
+    string item;
+    while (getline(list, item, ',')) {
+        size_t value;
+        if (!parseSize(item, value) || value > size_t(LzMatcher::MAX_LEVEL)) {
+            return false;
+        }
+        levels.push_back(int(value));
+    }
+    return !levels.empty();
+}
+
+void printUsage() {
+    cerr << "Usage: filezipper_bench [options]\n"
+         << "  --size=<n>[K|M]     bytes per corpus set (default 16M)\n"
+         << "  --levels=<list>     comma-separated levels to run (default 0,1,5)\n"
+         << "  --threads=<n>       engine worker threads (default 1)\n"
+         << "  --repeat=<n>        runs per case; the fastest is reported (default 3)\n"
+         << "  --files=<n>         small files per size class (default 200)\n";
+}
+
+int main(int argc, char* argv[]) {
+    size_t corpusSize = 16 << 20;
+    size_t threads = 1;
+    size_t repeat = 3;
+    size_t fileCount = 200;
+    vector<int> levels = { 0, 1, 5 };
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        bool ok = false;
+        if (option.rfind("--size=", 0) == 0) {
+            ok = parseSize(option.substr(7), corpusSize) && corpusSize > 0;
+        } else if (option.rfind("--levels=", 0) == 0) {
+            ok = parseLevels(option.substr(9), levels);
+        } else if (option.rfind("--threads=", 0) == 0) {
+            ok = parseSize(option.substr(10), threads) && threads > 0 && threads <= 1024;
+        } else if (option.rfind("--repeat=", 0) == 0) {
+            ok = parseSize(option.substr(9), repeat) && repeat > 0;
+        } else if (option.rfind("--files=", 0) == 0) {
+            ok = parseSize(option.substr(8), fileCount) && fileCount > 0;
+        }
+        if (!ok) {
+            cerr << "Invalid option: " << option << "\n";
+            printUsage();
+            return 2;
+        }
+    }
+
+    mt19937_64 rng(20240501);
+    vector<pair<string, vector<unsigned char>>> corpus;
+    corpus.push_back(make_pair(string("text"), makeText(corpusSize, rng)));
+    corpus.push_back(make_pair(string("logs"), makeLogs(corpusSize, rng)));
+    corpus.push_back(make_pair(string("random"), makeRandom(corpusSize, rng)));
+    corpus.push_back(make_pair(string("skewed"), makeSkewed(corpusSize, rng)));
+
+    // Small files: cut from the text and log sets at fixed sizes
+    const size_t smallSizes[] = { 256, 1 << 10, 4 << 10, 16 << 10, 64 << 10 };
+    const vector<unsigned char>& text = corpus[0].second;
+    const vector<unsigned char>& logs = corpus[1].second;
+
+    bool allVerified = true;
+    cout << "{\n"
+         << "  \"stream_version\": " << int(STREAM_VERSION) << ",\n"
+         << "  \"threads\": " << threads << ",\n"
+         << "  \"block_size\": " << DEFAULT_BLOCK_SIZE << ",\n"
+         << "  \"corpus_bytes\": " << corpusSize << ",\n"
+         << "  \"results\": [";
+    cout << fixed << setprecision(2);
+
+    bool first = true;
+    for (int level : levels) {
+        ParallelEngine engine(static_cast<int>(threads));
+        engine.setLevel(level);
+        for (const auto& set : corpus) {
+            Timing best = runOnce(engine, set.second);
+            for (size_t r = 1; r < repeat; r++) {
+                Timing timing = runOnce(engine, set.second);
+                best.compressSeconds = min(best.compressSeconds, timing.compressSeconds);
+                best.decompressSeconds = min(best.decompressSeconds, timing.decompressSeconds);
+                best.verified = best.verified && timing.verified;
+            }
+            allVerified = allVerified && best.verified;
+
+            double mb = double(set.second.size()) / 1e6;
+            cout << (first ? "\n" : ",\n")
+                 << "    {\"corpus\": \"" << set.first << "\", \"level\": " << level
+                 << ", \"input_bytes\": " << set.second.size()
+                 << ", \"output_bytes\": " << best.compressedSize
+                 << ", \"ratio\": " << double(set.second.size()) / double(best.compressedSize)
+                 << ", \"compress_mbps\": " << mb / best.compressSeconds
+                 << ", \"decompress_mbps\": " << mb / best.decompressSeconds
+                 << ", \"verified\": " << (best.verified ? "true" : "false") << "}";
+            first = false;
+        }
+    }
+    cout << "\n  ],\n  \"small_files\": [";
+
+    // Per-file latency for whole small files through the buffer API,
+    // single-threaded as a request handler would
+    first = true;
+    vector<unsigned char> packed;
+    vector<unsigned char> restored;
+    for (int level : levels) {
+        BlockCoder coder;
+        coder.setLevel(level);
+        for (size_t size : smallSizes) {
+            uniform_int_distribution<size_t> offset(0, corpusSize > size ? corpusSize - size : 0);
+            vector<double> compressTimes;
+            vector<double> decompressTimes;
+            uint64_t inputBytes = 0;
+            uint64_t outputBytes = 0;
+            bool verified = true;
+            for (size_t i = 0; i < fileCount; i++) {
+                const vector<unsigned char>& source = (i % 2) ? logs : text;
+                size_t start = offset(rng);
+                vector<unsigned char> file(source.begin() + start,
+                                           source.begin() + min(start + size, source.size()));
+                Timing timing = runBuffer(coder, file, packed, restored);
+                compressTimes.push_back(timing.compressSeconds);
+                decompressTimes.push_back(timing.decompressSeconds);
+                inputBytes += file.size();
+                outputBytes += timing.compressedSize;
+                verified = verified && timing.verified;
+            }
+            allVerified = allVerified && verified;
+
+            cout << (first ? "\n" : ",\n")
+                 << "    {\"size\": " << size << ", \"level\": " << level << ", \"files\": " << fileCount
+                 << ", \"ratio\": " << double(inputBytes) / double(outputBytes)
+                 << ", \"compress_us\": " << percentileJson(compressTimes)
+                 << ", \"decompress_us\": " << percentileJson(decompressTimes)
+                 << ", \"verified\": " << (verified ? "true" : "false") << "}";
+            first = false;
+        }
+    }
+    cout << "\n  ],\n"
+         << "  \"peak_rss_kb\": " << peakRssKb() << "\n"
+         << "}\n";
+    return allVerified ? 0 : 1;
+}
@@ -0,0 +1,660 @@
+#include "FileZipperCli.h"
+#include "FileZipperCore.h"
+
+#include <unordered_map>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+// Benchmark input: the given file, or 64 MB of synthetic log-like text
+vector<unsigned char> loadBenchmarkData(const string& inputFile) {
+    vector<unsigned char> data;
+    if (!inputFile.empty()) {
+        ifstream in(inputFile, ios::binary);
+        data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    } else {
+        const char* words[] = { "INFO ", "WARN ", "request ", "id=", "user ", "200 ", "GET ", "/api/v1/", "\n" };
+        uint32_t seed = 12345;
+        while (data.size() < (64u << 20)) {
+            seed = seed * 1103515245 + 12345;
+            const char* w = words[(seed >> 16) % 9];
+            data.insert(data.end(), w, w + strlen(w));
+        }
+    }
+    if (data.empty()) {
+        cerr << "Benchmark input is empty\n";
+    }
+    return data;
+}
+
+// Histogram benchmark: unordered_map<char, int> counting against the
+// interleaved-table kernel and its sampled variant
+void runHistogramBenchmark(const string& inputFile) {
+    vector<unsigned char> data = loadBenchmarkData(inputFile);
+    if (data.empty()) {
+        return;
+    }
+
+    double mb = data.size() / 1e6;
+    auto seconds = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+
+    auto start = chrono::steady_clock::now();
+    unordered_map<char, int> frequency;
+    for (unsigned char c : data) {
+        frequency[(char)c]++;
+    }
+    double mapTime = seconds(start);
+
+    start = chrono::steady_clock::now();
+    uint64_t counts[256] = { 0 };
+    countBytes(data.data(), data.size(), counts);
+    double kernelTime = seconds(start);
+
+    start = chrono::steady_clock::now();
+    uint64_t sampled[256] = { 0 };
+    countBytesSampled(data.data(), data.size(), sampled);
+    double sampledTime = seconds(start);
+
+    bool match = true;
+    for (int c = 0; c < 256; c++) {
+        auto it = frequency.find((char)c);
+        match = match && counts[c] == (it == frequency.end() ? 0u : uint64_t(unsigned(it->second)));
+    }
+
+    cout << "Histogram benchmark: " << mb << " MB input\n"
+         << "  unordered_map<char, int>:        " << mb / mapTime << " MB/s\n"
+         << "  uint64_t[256], 4 sub-tables:     " << mb / kernelTime << " MB/s\n"
+         << "  sampled (1 KiB of every " << HISTOGRAM_SAMPLE_STRIDE << "):     " << mb / sampledTime << " MB/s\n"
+         << "  counts " << (match ? "match" : "DIFFER") << "\n";
+}
+
+// Encode throughput benchmark: the old map<char, string> + per-bit writer
+// against the packed code table + 64-bit BitWriter, on the same data
+void runEncodeBenchmark(const string& inputFile) {
+    vector<unsigned char> data = loadBenchmarkData(inputFile);
+    if (data.empty()) {
+        return;
+    }
+
+    uint64_t frequency[256] = { 0 };
+    countBytes(data.data(), data.size(), frequency);
+    HuffmanCodec huffman;
+    huffman.buildTree(frequency);
+    huffman.generateHuffmanCodes();
+    const array<HuffmanCode, 256>& codes = huffman.getHuffmanCodes();
+
+    unordered_map<char, string> stringCodes;
+    for (int s = 0; s < 256; s++) {
+        string bits;
+        for (int i = codes[s].length - 1; i >= 0; i--) {
+            bits += ((codes[s].bits >> i) & 1) ? '1' : '0';
+        }
+        if (!bits.empty()) stringCodes[(char)s] = bits;
+    }
+
+    double mb = data.size() / 1e6;
+    auto seconds = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+
+    // Before: string lookup and copy per byte, ostream::put per output byte
+    ostringstream legacyOut;
+    auto start = chrono::steady_clock::now();
+    char byte = 0;
+    int bitCount = 0;
+    for (unsigned char c : data) {
+        string code = stringCodes[(char)c];
+        for (char bit : code) {
+            byte = (byte << 1) | (bit - '0');
+            if (++bitCount == 8) {
+                legacyOut.put(byte);
+                bitCount = 0;
+                byte = 0;
+            }
+        }
+    }
+    if (bitCount > 0) {
+        legacyOut.put(byte << (8 - bitCount));
+    }
+    double legacyTime = seconds(start);
+
+    // After: packed table and word-at-a-time writer
+    vector<unsigned char> packedOut;
+    start = chrono::steady_clock::now();
+    BitWriter writer(packedOut);
+    huffman.encodeBuffer(data.data(), data.size(), writer);
+    writer.finish();
+    double packedTime = seconds(start);
+
+    cout << "Encode benchmark: " << mb << " MB input\n"
+         << "  map<char, string> + per-bit writer: " << mb / legacyTime << " MB/s\n"
+         << "  packed table + 64-bit BitWriter:    " << mb / packedTime << " MB/s\n"
+         << "  outputs " << (legacyOut.str() == string(packedOut.begin(), packedOut.end()) ? "match" : "DIFFER") << "\n";
+}
+
+// Helper function to list the built-in static table names
+string tableNames() {
+    string names;
+    for (int i = 0; i < STATIC_TABLE_COUNT; i++) {
+        names += (i ? ", " : "") + string(STATIC_TABLES[i].name);
+    }
+    return names;
+}
+
+void printUsage() {
+    cerr << "Usage:\n"
+         << "  FileZipper                                   start the GUI (desktop build only)\n"
+         << "  FileZipper compress <input> <output> [options]\n"
+         << "  FileZipper decompress <input> <output> [options]\n"
+         << "  FileZipper verify <file or archive> [--full] [options]\n"
+         << "  FileZipper range <input> <output> <offset> <length>\n"
+         << "  FileZipper tail <input> <output> <length>\n"
+         << "  FileZipper archive <directory> <archive> [options]\n"
+         << "  FileZipper list <archive>\n"
+         << "  FileZipper extract <archive> <entry> <output>\n"
+         << "  FileZipper unarchive <archive> <directory> [options]\n"
+         << "  FileZipper history <store> [file]...\n"
+         << "  FileZipper --bench-encode [file]\n"
+         << "  FileZipper --bench-histogram [file]\n"
+         << "  FileZipper --train-table <name> <file or directory>... [--level=<1-9>]\n"
+         << "The headless filezipper tool takes the same commands.\n"
+         << "Use - as input or output for stdin/stdout.\n"
+         << "Options:\n"
+         << "  --block-size=<n>[K|M]   bytes per block (default 1M, max 64M)\n"
+         << "  --threads=<n>           worker threads (default: one per core)\n"
+         << "  --fast                  estimate block histograms from a sample\n"
+         << "  --level=<0-9>           match search effort; 0 is entropy coding only (default 0)\n"
+         << "  --codec=<name>          huffman, fse, static, or auto to pick per block (default auto)\n"
+         << "  --table=<name>          pretrained table for small inputs: " << tableNames() << "\n"
+         << "  --progress              report progress on stderr (compress/decompress/verify of files)\n"
+         << "  --full                  verify: also decode every block and check the original data\n"
+         << "  --history=<store>       record file runs (not -) in a history store and skip compressing unchanged files\n"
+         << "  --stats=json            print per-stage timings, bytes and block ratios (stdout, or stderr when\n"
+         << "                          the output is stdout)\n";
+}
+
+// Apply --block-size, --threads, --fast, --level, --codec and --table options from argv[first] on to an engine or archive;
+// --progress, --full, --history and --stats are accepted only when the caller passes somewhere to record them
+template <typename Target>
+bool parseOptions(int argc, char* argv[], int first, Target& target, bool* progress = NULL, bool* full = NULL,
+                  string* history = NULL, bool* stats = NULL) {
+    // Tables first, so --codec=static may come before --table
+    for (int i = first; i < argc; i++) {
+        string option = argv[i];
+        if (option.rfind("--table=", 0) == 0 && !target.setStaticTable(StaticCodec::findTable(option.substr(8)))) {
+            cerr << "Unknown table: " << option.substr(8) << "\n";
+            return false;
+        }
+    }
+    for (int i = first; i < argc; i++) {
+        string option = argv[i];
+        size_t size;
+        if (option == "--progress" && progress) {
+            *progress = true;
+            continue;
+        }
+        if (option == "--full" && full) {
+            *full = true;
+            continue;
+        }
+        if (option.rfind("--history=", 0) == 0 && option.size() > 10 && history) {
+            *history = option.substr(10);
+            continue;
+        }
+        if (option == "--stats=json" && stats) {
+            *stats = true;
+            continue;
+        }
+        if (option.rfind("--table=", 0) == 0) {
+            continue;
+        }
+        if (option == "--codec=static" && !target.setEntropyCodec(ENTROPY_STATIC)) {
+            cerr << "--codec=static needs --table=<name>\n";
+            return false;
+        }
+        if (option == "--codec=static") {
+            continue;
+        }
+        if (option.rfind("--block-size=", 0) == 0 && parseSize(option.substr(13), size) &&
+            target.setBlockSize(size)) {
+            continue;
+        }
+        if (option.rfind("--threads=", 0) == 0 && parseSize(option.substr(10), size) && size <= 1024) {
+            target.setThreadCount(int(size));
+            continue;
+        }
+        if (option == "--fast") {
+            target.setSampledHistogram(true);
+            continue;
+        }
+        if (option == "--codec=huffman" || option == "--codec=fse" || option == "--codec=auto") {
+            string name = option.substr(8);
+            target.setEntropyCodec(name == "huffman" ? ENTROPY_HUFFMAN : name == "fse" ? ENTROPY_FSE : ENTROPY_AUTO);
+            continue;
+        }
+        if (option.rfind("--level=", 0) == 0 && parseSize(option.substr(8), size) && size <= 9 &&
+            target.setLevel(int(size))) {
+            continue;
+        }
+        cerr << "Invalid option: " << option << "\n";
+        printUsage();
+        return false;
+    }
+    return true;
+}
+
+// Directory archives: archive, list, extract and unarchive
+int runArchiveCommand(const string& command, int argc, char* argv[]) {
+    FileArchive archive;
+    bool ok;
+    if (command == "archive" && argc >= 4) {
+        if (!parseOptions(argc, argv, 4, archive)) {
+            return 2;
+        }
+        ok = archive.create(argv[2], argv[3]);
+    } else if (command == "list" && argc == 3) {
+        vector<ArchiveEntry> entries;
+        ok = FileArchive::list(argv[2], entries);
+        for (const ArchiveEntry& entry : entries) {
+            time_t modified = time_t(entry.modifiedTime);
+            char stamp[32] = "";
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&modified));
+            cout << setw(14) << entry.originalSize << " " << setw(14) << entry.compressedSize
+                 << "  " << stamp << "  " << entry.name << "\n";
+        }
+    } else if (command == "extract" && argc == 5) {
+        ok = archive.extract(argv[2], argv[3], argv[4]);
+    } else if (command == "unarchive" && argc >= 4) {
+        if (!parseOptions(argc, argv, 4, archive)) {
+            return 2;
+        }
+        ok = archive.extractAll(argv[2], argv[3]);
+    } else {
+        printUsage();
+        return 2;
+    }
+
+    if (!ok) {
+        cerr << command << " failed\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Extract part of a compressed file by decoding only the blocks that cover it
+int runRangeCommand(const string& command, int argc, char* argv[]) {
+    bool isRange = (command == "range");
+    size_t first = 0;
+    size_t second = 0;
+    if (argc != (isRange ? 6 : 5) || !parseSize(argv[4], first) ||
+        (isRange && !parseSize(argv[5], second))) {
+        printUsage();
+        return 2;
+    }
+
+    string input = argv[2];
+    string output = argv[3];
+    ifstream in(input, ios::binary);
+    if (!in) {
+        cerr << "Cannot open input: " << input << "\n";
+        return 1;
+    }
+    ofstream outFile;
+    if (output != "-") {
+        outFile.open(output, ios::binary);
+        if (!outFile) {
+            cerr << "Cannot open output: " << output << "\n";
+            return 1;
+        }
+    }
+#ifdef _WIN32
+    if (output == "-") _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    ostream& out = (output == "-") ? cout : static_cast<ostream&>(outFile);
+
+    uint64_t offset = first;
+    uint64_t length = second;
+    if (!isRange) {
+        uint64_t total;
+        if (!BlockCoder::getUncompressedSize(in, total)) {
+            cerr << "No block index in " << input << "\n";
+            return 1;
+        }
+        length = min<uint64_t>(first, total);
+        offset = total - length;
+    }
+
+    BlockCoder coder;
+    if (!coder.decompressRange(in, offset, length, out)) {
+        cerr << command << " failed\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Run one file-to-file job on the background queue, optionally reporting
+// progress to stderr about four times a second and stage statistics as JSON
+int runFileJob(JobQueue& jobs, JobType type, const string& input, const string& output, bool showProgress,
+               bool showStats = false) {
+    if (showProgress) {
+        auto lastReport = make_shared<chrono::steady_clock::time_point>();
+        jobs.setProgressCallback([lastReport](const JobStatus& status) {
+            auto now = chrono::steady_clock::now();
+            if (!status.finished() && now - *lastReport < chrono::milliseconds(250)) {
+                return;
+            }
+            *lastReport = now;
+            double percent = status.totalBytes ? 100.0 * status.bytesIn / status.totalBytes : 100.0;
+            cerr << "\r" << fixed << setprecision(1) << min(percent, 100.0) << "%  "
+                 << (status.bytesIn >> 20) << " MB in, " << (status.bytesOut >> 20) << " MB out, "
+                 << status.mbps << " MB/s";
+            if (status.etaSeconds >= 0.0) {
+                cerr << ", ETA " << status.etaSeconds << " s";
+            }
+            cerr << "   " << (status.finished() ? "\n" : "") << flush;
+        });
+    }
+
+    int id = jobs.submit(type, input, output);
+    JobStatus status = jobs.wait(id);
+    RunStats stats;
+    if (showStats && jobs.getStats(id, stats)) {
+        stats.writeJson(cout);
+    }
+    if (status.state != JOB_DONE) {
+        cerr << (type == JOB_COMPRESS ? "compress" : type == JOB_DECOMPRESS ? "decompress" : "verify")
+             << " failed\n";
+        return 1;
+    }
+    if (status.reused) {
+        cerr << input << ": unchanged, kept " << output << "\n";
+    }
+    return 0;
+}
+
+// Print what a history store knows about each file: its runs, newest first,
+// and other inputs whose content was compressed identically
+int runHistoryCommand(int argc, char* argv[]) {
+    HistoryStore store;
+    if (!fs::exists(argv[2]) || !store.open(argv[2])) {
+        cerr << "Cannot open history store: " << argv[2] << "\n";
+        return 1;
+    }
+    cout << store.size() << (store.size() == 1 ? " record\n" : " records\n");
+    for (int i = 3; i < argc; i++) {
+        vector<HistoryRecord> records = store.findByPath(argv[i]);
+        if (records.empty()) {
+            cout << argv[i] << ": no history\n";
+            continue;
+        }
+        cout << records.front().inputPath << ":\n";
+        uint64_t contentHash = 0;
+        for (const HistoryRecord& record : records) {
+            time_t when = time_t(record.time);
+            char stamp[32] = "";
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&when));
+            cout << "  " << stamp << "  " << (record.operation == HISTORY_COMPRESS ? "compress  " : "decompress")
+                 << "  " << setw(12) << record.inputSize << " -> " << setw(12) << record.outputSize
+                 << "  " << record.outputPath << "\n";
+            if (record.operation == HISTORY_COMPRESS && contentHash == 0) {
+                contentHash = record.contentHash;
+            }
+        }
+        if (contentHash != 0) {
+            cout << "  content " << hex << setw(16) << setfill('0') << contentHash << dec << setfill(' ') << "\n";
+            for (const HistoryRecord& record : store.findByContent(contentHash)) {
+                if (record.inputPath != records.front().inputPath) {
+                    cout << "  same content: " << record.inputPath << "\n";
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Check a compressed file, archive or stdin against its checksums without
+// writing anything
+int runVerifyCommand(int argc, char* argv[]) {
+    string input = argv[2];
+    bool fullDecode = false;
+    bool showProgress = false;
+    bool showStats = false;
+    char magic[sizeof(ARCHIVE_MAGIC)] = {};
+    if (input != "-") {
+        ifstream probe(input, ios::binary);
+        if (!probe) {
+            cerr << "Cannot open input: " << input << "\n";
+            return 1;
+        }
+        probe.read(magic, sizeof(magic));
+    }
+
+    int result;
+    if (memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) == 0) {
+        FileArchive archive;
+        if (!parseOptions(argc, argv, 3, archive, NULL, &fullDecode)) {
+            return 2;
+        }
+        result = archive.verify(input, fullDecode) ? 0 : 1;
+        if (result != 0) {
+            cerr << "verify failed\n";
+        }
+    } else {
+        JobQueue jobs;
+        ParallelEngine& engine = jobs.getSettings();
+        if (!parseOptions(argc, argv, 3, engine, &showProgress, &fullDecode, NULL, &showStats)) {
+            return 2;
+        }
+        if (input != "-") {
+            result = runFileJob(jobs, fullDecode ? JOB_VERIFY_FULL : JOB_VERIFY, input, "", showProgress,
+                                showStats);
+        } else {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            ios::sync_with_stdio(false);
+            result = engine.verifyStream(cin, fullDecode) ? 0 : 1;
+            if (showStats) {
+                engine.getLastStats().writeJson(cout);
+            }
+            if (result != 0) {
+                cerr << "verify failed\n";
+            }
+        }
+    }
+    // The JSON document owns stdout, so it stays parseable when piped
+    if (result == 0) {
+        (showStats ? cerr : cout) << input << ": OK\n";
+    }
+    return result;
+}
+
+// Build a static table from sample files and print it as a FileZipperTables.h
+// entry. Every symbol gets a code, so the table can code any input.
+int runTrainTable(int argc, char* argv[]) {
+    string name = argv[2];
+    size_t level = 5;
+    vector<fs::path> files;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.rfind("--level=", 0) == 0) {
+            if (!parseSize(arg.substr(8), level) || level < 1 || level > 9) {
+                printUsage();
+                return 2;
+            }
+        } else if (fs::is_directory(arg)) {
+            for (const fs::directory_entry& entry : fs::recursive_directory_iterator(arg)) {
+                if (entry.is_regular_file()) {
+                    files.push_back(entry.path());
+                }
+            }
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    // Slot 0 counts raw bytes; slots 1-4 the LZ streams at the given level
+    static uint64_t counts[STATIC_SLOT_COUNT][256];
+    LzMatcher matcher;
+    matcher.setLevel(int(level));
+    LzSequences sequences;
+    uint64_t total = 0;
+    for (const fs::path& file : files) {
+        ifstream in(file, ios::binary);
+        vector<unsigned char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        for (size_t start = 0; start < data.size(); start += DEFAULT_BLOCK_SIZE) {
+            size_t size = min(DEFAULT_BLOCK_SIZE, data.size() - start);
+            countBytes(data.data() + start, size, counts[0]);
+            matcher.parse(data.data() + start, size, sequences);
+            const vector<unsigned char>* streams[4] = {
+                &sequences.literals, &sequences.literalLengthCodes,
+                &sequences.matchLengthCodes, &sequences.offsetCodes
+            };
+            for (int i = 0; i < 4; i++) {
+                if (!streams[i]->empty()) {
+                    countBytes(streams[i]->data(), streams[i]->size(), counts[1 + i]);
+                }
+            }
+        }
+        total += data.size();
+    }
+    if (total == 0) {
+        cerr << "No training data\n";
+        return 1;
+    }
+
+    cout << "    { \"" << name << "\", {\n";
+    HuffmanCodec huffman;
+    for (int slot = 0; slot < STATIC_SLOT_COUNT; slot++) {
+        int alphabet = slot < 2 ? 256 : MAX_VALUE_CODE + 1;
+        uint64_t frequency[256] = {};
+        for (int c = 0; c < alphabet; c++) {
+            frequency[c] = counts[slot][c] + 1;
+        }
+        huffman.prepare(frequency);
+        const unsigned char* lengths = huffman.getCodeLengths();
+        string digits;
+        for (int c = 0; c < alphabet; c++) {
+            digits += "0123456789ABCDEF"[lengths[c]];
+        }
+        cout << "        \"" << digits << "\"" << (slot + 1 < STATIC_SLOT_COUNT ? ",\n" : " } },\n");
+    }
+    cerr << "Trained on " << files.size() << " files, " << total << " bytes\n";
+    return 0;
+}
+
+int runCommandLine(int argc, char* argv[]) {
+    string command = argv[1];
+    if (command == "--bench-encode") {
+        runEncodeBenchmark(argc > 2 ? argv[2] : "");
+        return 0;
+    }
+    if (command == "--bench-histogram") {
+        runHistogramBenchmark(argc > 2 ? argv[2] : "");
+        return 0;
+    }
+    if (command == "--train-table" && argc >= 4) {
+        return runTrainTable(argc, argv);
+    }
+    if (command == "history" && argc >= 3) {
+        return runHistoryCommand(argc, argv);
+    }
+    if (command == "verify" && argc >= 3) {
+        return runVerifyCommand(argc, argv);
+    }
+    if (command == "range" || command == "tail") {
+        return runRangeCommand(command, argc, argv);
+    }
+    if (command == "archive" || command == "list" || command == "extract" || command == "unarchive") {
+        return runArchiveCommand(command, argc, argv);
+    }
+    if ((command != "compress" && command != "decompress") || argc < 4) {
+        printUsage();
+        return 2;
+    }
+
+    // Declared before the queue so it outlives the runners that record into it
+    HistoryStore history;
+    JobQueue jobs;
+    ParallelEngine& engine = jobs.getSettings();
+    bool showProgress = false;
+    bool showStats = false;
+    string historyPath;
+    if (!parseOptions(argc, argv, 4, engine, &showProgress, NULL, &historyPath, &showStats)) {
+        return 2;
+    }
+    string input = argv[2];
+    string output = argv[3];
+    if (!historyPath.empty() && (input == "-" || output == "-")) {
+        cerr << "--history needs a file input and output, not -\n";
+        return 2;
+    }
+    if (!historyPath.empty()) {
+        if (!history.open(historyPath)) {
+            return 1;
+        }
+        jobs.setHistory(&history);
+    }
+
+    if (input != "-" && output != "-") {
+        return runFileJob(jobs, command == "compress" ? JOB_COMPRESS : JOB_DECOMPRESS, input, output,
+                          showProgress, showStats);
+    }
+    ios::sync_with_stdio(false);
+#ifdef _WIN32
+    if (input == "-") _setmode(_fileno(stdin), _O_BINARY);
+    if (output == "-") _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    ifstream inFile;
+    ofstream outFile;
+    if (input != "-") {
+        inFile.open(input, ios::binary);
+        if (!inFile) {
+            cerr << "Cannot open input: " << input << "\n";
+            return 1;
+        }
+    }
+    if (output != "-") {
+        outFile.open(output, ios::binary);
+        if (!outFile) {
+            cerr << "Cannot open output: " << output << "\n";
+            return 1;
+        }
+    }
+    istream& in = (input == "-") ? cin : static_cast<istream&>(inFile);
+    ostream& out = (output == "-") ? cout : static_cast<ostream&>(outFile);
+
+    bool ok;
+    if (command == "compress") {
+        string extension = (input == "-") ? "" : fs::path(input).extension().string();
+        ok = engine.compressStream(in, out, extension);
+    } else {
+        ok = engine.decompressStream(in, out);
+    }
+    if (showStats) {
+        engine.getLastStats().writeJson(output == "-" ? cerr : cout);
+    }
+
+    if (!ok) {
+        cerr << command << " failed\n";
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef FILEZIPPER_CLI_MAIN
+// Headless tool: the same commands as the GUI executable, without a window
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printUsage();
+        return 2;
+    }
+    return runCommandLine(argc, argv);
+}
+#endif
@@ -0,0 +1,10 @@
+// FileZipper command line: compress, decompress, verify, archives, history
+// and the benchmarks, between files and pipes. Needs only the core library,
+// so it builds as the headless filezipper tool as well as inside the GUI.
+#ifndef FILEZIPPER_CLI_H
+#define FILEZIPPER_CLI_H
+
+// Run the command in argv[1]; returns the process exit code
+int runCommandLine(int argc, char* argv[]);
+
+#endif
@@ -0,0 +1,2286 @@
+#include "FileZipperCore.h"
+
+#include <iomanip>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+// Bit-reflected CRC32C polynomial
+static const uint32_t CRC32C_POLY = 0x82F63B78;
+
+// Tables for the portable path: table[k][b] is the CRC of byte b followed by k zero bytes
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t crc = n;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            table[0][n] = crc;
+        }
+        for (uint32_t n = 0; n < 256; n++) {
+            for (int k = 1; k < 8; k++) {
+                table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+            }
+        }
+    }
+};
+
+// Helper function to update a CRC eight bytes at a time with table lookups
+static uint32_t crc32cPortable(uint32_t crc, const unsigned char* data, size_t size) {
+    static const Crc32cTables tables;
+    const uint32_t (*t)[256] = tables.table;
+    while (size >= 8) {
+        uint32_t low = crc ^ (uint32_t(data[0]) | uint32_t(data[1]) << 8 |
+                              uint32_t(data[2]) << 16 | uint32_t(data[3]) << 24);
+        uint32_t high = uint32_t(data[4]) | uint32_t(data[5]) << 8 |
+                        uint32_t(data[6]) << 16 | uint32_t(data[7]) << 24;
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef __GNUC__
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    uint64_t wide = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = uint32_t(wide);
+    while (size-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+static bool hasHardwareCrc() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+
+static bool hasHardwareCrc() {
+    return true;
+}
+#else
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    return crc32cPortable(crc, data, size);
+}
+
+static bool hasHardwareCrc() {
+    return false;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t size) {
+    static const bool hardware = hasHardwareCrc();
+    crc = ~crc;
+    crc = hardware ? crc32cHardware(crc, data, size) : crc32cPortable(crc, data, size);
+    return ~crc;
+}
+
+// Helper function to multiply two polynomials modulo the CRC polynomial
+static uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t sizeB) {
+    // Shift crcA past sizeB zero bytes: multiply by x^(8 * sizeB), built from
+    // repeated squares of x^8
+    uint32_t shift = 1u << 31;      // x^0
+    uint32_t square = 1u << 23;     // x^8
+    for (; sizeB != 0; sizeB >>= 1) {
+        if (sizeB & 1) {
+            shift = crc32cMultiply(square, shift);
+        }
+        square = crc32cMultiply(square, square);
+    }
+    return crc32cMultiply(shift, crcA) ^ crcB;
+}
+
+double threadCpuSeconds() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) {
+        return 0.0;
+    }
+    uint64_t ticks = ((uint64_t(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime) +
+                     ((uint64_t(user.dwHighDateTime) << 32) | user.dwLowDateTime);
+    return double(ticks) * 1e-7;
+#else
+    timespec now;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) != 0) {
+        return 0.0;
+    }
+    return double(now.tv_sec) + double(now.tv_nsec) * 1e-9;
+#endif
+}
+
+static const uint64_t XXH_PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t XXH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t XXH_PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t XXH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t XXH_PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return rotateLeft(acc, 31) * XXH_PRIME1;
+}
+
+static inline uint64_t xxhMerge(uint64_t hash, uint64_t acc) {
+    hash ^= xxhRound(0, acc);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static inline uint64_t loadLittle64(const unsigned char* data) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+void XxHash64::reset(uint64_t newSeed) {
+    seed = newSeed;
+    acc[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+    acc[1] = seed + XXH_PRIME2;
+    acc[2] = seed;
+    acc[3] = seed - XXH_PRIME1;
+    buffered = 0;
+    total = 0;
+}
+
+void XxHash64::update(const unsigned char* data, size_t size) {
+    total += size;
+    if (buffered + size < sizeof(buffer)) {
+        memcpy(buffer + buffered, data, size);
+        buffered += size;
+        return;
+    }
+    if (buffered > 0) {
+        size_t fill = sizeof(buffer) - buffered;
+        memcpy(buffer + buffered, data, fill);
+        for (int lane = 0; lane < 4; lane++) {
+            acc[lane] = xxhRound(acc[lane], loadLittle64(buffer + 8 * lane));
+        }
+        data += fill;
+        size -= fill;
+        buffered = 0;
+    }
+    // Four independent lanes of 8 bytes per 32-byte stripe
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    for (; size >= 32; data += 32, size -= 32) {
+        a0 = xxhRound(a0, loadLittle64(data));
+        a1 = xxhRound(a1, loadLittle64(data + 8));
+        a2 = xxhRound(a2, loadLittle64(data + 16));
+        a3 = xxhRound(a3, loadLittle64(data + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    memcpy(buffer, data, size);
+    buffered = size;
+}
+
+uint64_t XxHash64::digest() const {
+    uint64_t hash;
+    if (total >= 32) {
+        hash = rotateLeft(acc[0], 1) + rotateLeft(acc[1], 7) + rotateLeft(acc[2], 12) + rotateLeft(acc[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            hash = xxhMerge(hash, acc[lane]);
+        }
+    } else {
+        hash = seed + XXH_PRIME5;
+    }
+    hash += total;
+
+    const unsigned char* data = buffer;
+    size_t size = buffered;
+    for (; size >= 8; data += 8, size -= 8) {
+        hash ^= xxhRound(0, loadLittle64(data));
+        hash = rotateLeft(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (size >= 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        hash ^= uint64_t(word) * XXH_PRIME1;
+        hash = rotateLeft(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        data += 4;
+        size -= 4;
+    }
+    for (; size > 0; data++, size--) {
+        hash ^= *data * XXH_PRIME5;
+        hash = rotateLeft(hash, 11) * XXH_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+size_t BlockCoder::readBlock(istream& in, vector<unsigned char>& buffer) {
+    StageTimer timer(&stageStats, STAGE_READ);
+    in.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    timer.addBytes(uint64_t(in.gcount()));
+    return size_t(in.gcount());
+}
+
+vector<unsigned char> BlockCoder::readRemaining(ifstream& inFile) {
+    streampos start = inFile.tellg();
+    inFile.seekg(0, ios::end);
+    streamoff size = inFile.tellg() - start;
+    inFile.seekg(start);
+
+    vector<unsigned char> data(size > 0 ? size_t(size) : 0);
+    inFile.read(reinterpret_cast<char*>(data.data()), data.size());
+    return data;
+}
+
+bool BlockCoder::decompressLegacy(ifstream& inFile, ofstream& outFile) {
+    // Skip file extension header
+    size_t extLen;
+    inFile.read(reinterpret_cast<char*>(&extLen), sizeof(extLen));
+    inFile.seekg(extLen, ios::cur);
+
+    // Read frequency table
+    size_t freqSize;
+    inFile.read(reinterpret_cast<char*>(&freqSize), sizeof(freqSize));
+    if (!inFile || freqSize > 256) {
+        cerr << "Decompression error: corrupt header\n";
+        return false;
+    }
+
+    uint64_t frequency[256] = { 0 };
+    uint64_t totalSymbols = 0;
+    for (size_t i = 0; i < freqSize; i++) {
+        unsigned char ch;
+        int freq;
+        inFile.read(reinterpret_cast<char*>(&ch), sizeof(ch));
+        inFile.read(reinterpret_cast<char*>(&freq), sizeof(int));
+        frequency[ch] = (unsigned)freq;
+        totalSymbols += (unsigned)freq;
+    }
+
+    // Rebuild Huffman codes
+    HuffmanCodec& codec = huffman[0];
+    codec.buildLegacyTree(frequency);
+    codec.generateHuffmanCodes();
+
+    HuffmanDecoder decoder;
+    if (!decoder.build(codec.getCodeLengths())) {
+        cerr << "Decompression error: invalid code lengths\n";
+        return false;
+    }
+
+    // Decode compressed data in chunks
+    vector<unsigned char> payload = readRemaining(inFile);
+    BitReader reader(payload.data(), payload.size());
+    vector<unsigned char> chunk(1 << 20);
+#ifdef FILEZIPPER_CHECK_DECODER
+    size_t treeBitPos = 0;
+#endif
+    while (totalSymbols > 0) {
+        size_t count = size_t(min<uint64_t>(totalSymbols, chunk.size()));
+        if (!decoder.decode(reader, chunk.data(), count)) {
+            cerr << "Decompression error: corrupt data\n";
+            return false;
+        }
+#ifdef FILEZIPPER_CHECK_DECODER
+        if (!codec.checkAgainstTree(payload.data(), payload.size(), treeBitPos, chunk.data(), count, frequency)) {
+            return false;
+        }
+#endif
+        outFile.write(reinterpret_cast<const char*>(chunk.data()), count);
+        totalSymbols -= count;
+    }
+    return true;
+}
+
+bool BlockCoder::parseStreamHeader(const unsigned char* data, unsigned char& version, size_t& extensionSize) {
+    version = data[sizeof(STREAM_MAGIC)];
+    extensionSize = data[sizeof(STREAM_MAGIC) + 1];
+    return memcmp(data, STREAM_MAGIC, sizeof(STREAM_MAGIC)) == 0 && version != 0 && version <= STREAM_VERSION;
+}
+
+void BlockCoder::storeStreamHeader(unsigned char* out, const string& extension) {
+    size_t extLen = streamHeaderSize(extension) - HEADER_SIZE;
+    memcpy(out, STREAM_MAGIC, sizeof(STREAM_MAGIC));
+    out[sizeof(STREAM_MAGIC)] = STREAM_VERSION;
+    out[sizeof(STREAM_MAGIC) + 1] = (unsigned char)extLen;
+    memcpy(out + HEADER_SIZE, extension.data(), extLen);
+}
+
+bool BlockCoder::readStreamHeader(istream& in, string& extension, unsigned char& version) {
+    unsigned char header[HEADER_SIZE];
+    size_t extLen;
+    version = 0;
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!in || !parseStreamHeader(header, version, extLen)) {
+        return false;
+    }
+
+    extension.assign(extLen, '\0');
+    in.read(&extension[0], extLen);
+    return bool(in);
+}
+
+size_t BlockCoder::writeStreamHeader(ostream& out, const string& extension) {
+    unsigned char header[HEADER_SIZE + 255];
+    size_t size = streamHeaderSize(extension);
+    storeStreamHeader(header, extension);
+    out.write(reinterpret_cast<const char*>(header), size);
+    return size;
+}
+
+// Helper function to compute the frame CRC: the header fields before it, then the body
+static uint32_t frameChecksum(const BlockFrame& frame, const unsigned char* body) {
+    uint32_t fields[3] = { frame.rawSize, frame.bodySize, frame.rawCrc };
+    uint32_t crc = crc32c(0, reinterpret_cast<const unsigned char*>(fields), sizeof(fields));
+    return crc32c(crc, body, frame.bodySize);
+}
+
+BlockFrame BlockCoder::makeFrame(size_t rawSize, uint32_t rawCrc, const vector<unsigned char>& body) {
+    BlockFrame frame = { uint32_t(rawSize), uint32_t(body.size()), rawCrc, 0 };
+    frame.frameCrc = frameChecksum(frame, body.data());
+    return frame;
+}
+
+bool BlockCoder::checkFrame(const BlockFrame& frame, const unsigned char* body, unsigned char version) {
+    return version < 4 || frameChecksum(frame, body) == frame.frameCrc;
+}
+
+bool BlockCoder::checkStreamEnd(const BlockFrame& frame, unsigned char version, uint32_t streamCrc) {
+    if (version >= 4 && (!checkFrame(frame, NULL, version) || frame.rawCrc != streamCrc)) {
+        cerr << "Decompression error: stream checksum mismatch\n";
+        return false;
+    }
+    return true;
+}
+
+void BlockCoder::storeFrame(unsigned char* out, const BlockFrame& frame) {
+    uint32_t fields[4] = { frame.rawSize, frame.bodySize, frame.rawCrc, frame.frameCrc };
+    memcpy(out, fields, sizeof(fields));
+}
+
+bool BlockCoder::writeBlock(ostream& out, const BlockFrame& frame, const vector<unsigned char>& body) {
+    unsigned char header[sizeof(BlockFrame)];
+    storeFrame(header, frame);
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(body.data()), body.size());
+    return bool(out);
+}
+
+bool BlockCoder::parseBlockHeader(const unsigned char* data, unsigned char version, BlockFrame& frame) {
+    uint32_t fields[4] = { 0, 0, 0, 0 };
+    memcpy(fields, data, frameHeaderSize(version));
+    if (fields[0] > MAX_BLOCK_SIZE || fields[1] > 2 * MAX_BLOCK_SIZE || (fields[0] == 0 && fields[1] != 0)) {
+        cerr << "Decompression error: corrupt block header\n";
+        return false;
+    }
+    frame = BlockFrame{ fields[0], fields[1], fields[2], fields[3] };
+    return true;
+}
+
+bool BlockCoder::readBlockHeader(istream& in, unsigned char version, BlockFrame& frame) {
+    unsigned char header[sizeof(BlockFrame)];
+    in.read(reinterpret_cast<char*>(header), frameHeaderSize(version));
+    if (!in) {
+        cerr << "Decompression error: truncated stream\n";
+        return false;
+    }
+    return parseBlockHeader(header, version, frame);
+}
+
+bool BlockCoder::compressFrame(const unsigned char* data, size_t size, vector<unsigned char>& body,
+                               BlockFrame& frame) {
+    if (!compressBlock(data, size, body)) {
+        return false;
+    }
+    StageTimer timer(&stageStats, STAGE_CHECKSUM, size + body.size());
+    frame = makeFrame(size, crc32c(0, data, size), body);
+    return true;
+}
+
+bool BlockCoder::decodeFrame(const BlockFrame& frame, const unsigned char* body, unsigned char* out,
+                             unsigned char version, uint32_t& streamCrc) {
+    bool intact;
+    {
+        StageTimer timer(&stageStats, STAGE_CHECKSUM, frame.bodySize);
+        intact = checkFrame(frame, body, version);
+    }
+    if (!intact) {
+        cerr << "Decompression error: checksum mismatch\n";
+        return false;
+    }
+    if (!decompressBlock(body, frame.bodySize, out, frame.rawSize, version)) {
+        cerr << "Decompression error: corrupt data\n";
+        return false;
+    }
+    if (version >= 4) {
+        StageTimer timer(&stageStats, STAGE_CHECKSUM, frame.rawSize);
+        uint32_t rawCrc = crc32c(0, out, frame.rawSize);
+        if (rawCrc != frame.rawCrc) {
+            cerr << "Decompression error: checksum mismatch\n";
+            return false;
+        }
+        streamCrc = crc32cCombine(streamCrc, rawCrc, frame.rawSize);
+    }
+    return true;
+}
+
+bool BlockCoder::compressStream(istream& in, ostream& out, const string& extension) {
+    BlockIndex& index = streamIndex;
+    index.start(writeStreamHeader(out, extension));
+
+    vector<unsigned char>& block = streamBlock;
+    vector<unsigned char>& body = streamBody;
+    block.resize(blockSize);
+    uint32_t streamCrc = 0;
+    while (true) {
+        size_t rawSize = readBlock(in, block);
+        if (rawSize == 0) {
+            break;
+        }
+
+        body.clear();
+        BlockFrame frame;
+        if (!compressFrame(block.data(), rawSize, body, frame)) {
+            return false;
+        }
+        StageTimer timer(&stageStats, STAGE_WRITE, frameHeaderSize(STREAM_VERSION) + body.size());
+        if (!writeBlock(out, frame, body)) {
+            return false;
+        }
+        index.add(rawSize, body.size());
+        streamCrc = crc32cCombine(streamCrc, frame.rawCrc, rawSize);
+    }
+
+    // End of stream marker and block index
+    body.clear();
+    writeBlock(out, makeFrame(0, streamCrc, body), body);
+    index.write(out);
+    out.flush();
+    return bool(out) && !in.bad();
+}
+
+bool BlockCoder::decompressStream(istream& in, ostream& out) {
+    string extension;
+    unsigned char version;
+    if (!readStreamHeader(in, extension, version)) {
+        cerr << "Decompression error: not a FileZipper stream\n";
+        return false;
+    }
+
+    vector<unsigned char>& body = streamBody;
+    vector<unsigned char>& block = streamBlock;
+    uint32_t streamCrc = 0;
+    BlockFrame frame;
+    while (true) {
+        if (!readBlockHeader(in, version, frame)) {
+            return false;
+        }
+        if (frame.rawSize == 0) {
+            break;
+        }
+
+        body.resize(frame.bodySize);
+        block.resize(frame.rawSize);
+        {
+            StageTimer timer(&stageStats, STAGE_READ, body.size());
+            in.read(reinterpret_cast<char*>(body.data()), body.size());
+        }
+        if (!in) {
+            cerr << "Decompression error: truncated stream\n";
+            return false;
+        }
+        if (!decodeFrame(frame, body.data(), block.data(), version, streamCrc)) {
+            return false;
+        }
+        StageTimer timer(&stageStats, STAGE_WRITE, block.size());
+        out.write(reinterpret_cast<const char*>(block.data()), block.size());
+        if (!out) {
+            return false;
+        }
+    }
+    out.flush();
+    return checkStreamEnd(frame, version, streamCrc) && bool(out);
+}
+
+bool BlockCoder::decompressRange(istream& in, uint64_t offset, uint64_t length, ostream& out) {
+    string extension;
+    unsigned char version;
+    in.clear();
+    in.seekg(0);
+    if (!readStreamHeader(in, extension, version)) {
+        cerr << "Decompression error: not a FileZipper stream\n";
+        return false;
+    }
+
+    vector<BlockIndexEntry> entries;
+    if (!BlockIndex::read(in, entries)) {
+        cerr << "Decompression error: no block index; decompress the whole file instead\n";
+        return false;
+    }
+
+    // First block whose data ends after offset
+    auto it = upper_bound(entries.begin(), entries.end(), offset,
+        [](uint64_t value, const BlockIndexEntry& entry) {
+            return value < entry.rawOffset + entry.rawSize;
+        });
+
+    vector<unsigned char> body;
+    vector<unsigned char> block;
+    for (; it != entries.end() && length > 0; ++it) {
+        BlockFrame frame;
+        in.clear();
+        in.seekg(streamoff(it->compressedOffset));
+        if (!readBlockHeader(in, version, frame) || frame.rawSize != it->rawSize) {
+            cerr << "Decompression error: block index does not match stream\n";
+            return false;
+        }
+
+        uint32_t rawSize = frame.rawSize;
+        body.resize(frame.bodySize);
+        block.resize(rawSize);
+        in.read(reinterpret_cast<char*>(body.data()), body.size());
+        if (!in || !checkFrame(frame, body.data(), version) ||
+            !decompressBlock(body.data(), body.size(), block.data(), block.size(), version) ||
+            (version >= 4 && crc32c(0, block.data(), block.size()) != frame.rawCrc)) {
+            cerr << "Decompression error: corrupt data\n";
+            return false;
+        }
+
+        uint64_t skip = offset > it->rawOffset ? offset - it->rawOffset : 0;
+        uint64_t count = min<uint64_t>(rawSize - skip, length);
+        out.write(reinterpret_cast<const char*>(block.data() + skip), streamsize(count));
+        offset += count;
+        length -= count;
+    }
+    out.flush();
+    return bool(out);
+}
+
+bool BlockCoder::getUncompressedSize(istream& in, uint64_t& size) {
+    vector<BlockIndexEntry> entries;
+    if (!BlockIndex::read(in, entries)) {
+        return false;
+    }
+    size = entries.empty() ? 0 : entries.back().rawOffset + entries.back().rawSize;
+    return true;
+}
+
+size_t BlockCoder::compressBound(size_t size, size_t blockSize) {
+    size_t blocks = (size + blockSize - 1) / blockSize;
+    size_t perBlock = frameHeaderSize(STREAM_VERSION) + 1 + BlockIndex::ENTRY_SIZE;
+    return HEADER_SIZE + size + blocks * perBlock + frameHeaderSize(STREAM_VERSION) + BlockIndex::TRAILER_SIZE;
+}
+
+bool BlockCoder::compressBuffer(const unsigned char* data, size_t size, unsigned char* out, size_t capacity,
+                                size_t& written) {
+    written = 0;
+    size_t frameSize = frameHeaderSize(STREAM_VERSION);
+    if (capacity < HEADER_SIZE) {
+        cerr << "Compression error: output buffer too small\n";
+        return false;
+    }
+    storeStreamHeader(out, string());
+    size_t pos = HEADER_SIZE;
+
+    BlockIndex& index = streamIndex;
+    vector<unsigned char>& body = streamBody;
+    index.start(pos);
+    uint32_t streamCrc = 0;
+    BlockFrame frame;
+    for (size_t offset = 0; offset < size; offset += blockSize) {
+        size_t rawSize = min(blockSize, size - offset);
+        body.clear();
+        if (!compressFrame(data + offset, rawSize, body, frame)) {
+            return false;
+        }
+        if (capacity - pos < frameSize + body.size()) {
+            cerr << "Compression error: output buffer too small\n";
+            return false;
+        }
+        storeFrame(out + pos, frame);
+        memcpy(out + pos + frameSize, body.data(), body.size());
+        pos += frameSize + body.size();
+        index.add(rawSize, body.size());
+        streamCrc = crc32cCombine(streamCrc, frame.rawCrc, rawSize);
+    }
+
+    // End of stream marker and block index
+    body.clear();
+    if (capacity - pos < frameSize + index.storedSize()) {
+        cerr << "Compression error: output buffer too small\n";
+        return false;
+    }
+    storeFrame(out + pos, makeFrame(0, streamCrc, body));
+    pos += frameSize;
+    index.store(out + pos);
+    written = pos + index.storedSize();
+    return true;
+}
+
+bool BlockCoder::decompressBuffer(const unsigned char* data, size_t size, unsigned char* out, size_t capacity,
+                                  size_t& written) {
+    written = 0;
+    unsigned char version;
+    size_t extLen;
+    if (size < HEADER_SIZE || !parseStreamHeader(data, version, extLen) || size - HEADER_SIZE < extLen) {
+        cerr << "Decompression error: not a FileZipper stream\n";
+        return false;
+    }
+
+    // Blocks are decoded from the input where they lie, straight into out
+    size_t pos = HEADER_SIZE + extLen;
+    size_t frameSize = frameHeaderSize(version);
+    uint32_t streamCrc = 0;
+    BlockFrame frame;
+    while (true) {
+        if (size - pos < frameSize) {
+            cerr << "Decompression error: truncated stream\n";
+            return false;
+        }
+        if (!parseBlockHeader(data + pos, version, frame)) {
+            return false;
+        }
+        pos += frameSize;
+        if (frame.rawSize == 0) {
+            break;
+        }
+
+        if (size - pos < frame.bodySize) {
+            cerr << "Decompression error: truncated stream\n";
+            return false;
+        }
+        if (capacity - written < frame.rawSize) {
+            cerr << "Decompression error: output buffer too small\n";
+            return false;
+        }
+        if (!decodeFrame(frame, data + pos, out + written, version, streamCrc)) {
+            return false;
+        }
+        pos += frame.bodySize;
+        written += frame.rawSize;
+    }
+    return checkStreamEnd(frame, version, streamCrc);
+}
+
+bool BlockCoder::getUncompressedSize(const unsigned char* data, size_t size, uint64_t& result) {
+    const size_t TRAILER_SIZE = BlockIndex::TRAILER_SIZE;
+    const size_t ENTRY_SIZE = BlockIndex::ENTRY_SIZE;
+    if (size < TRAILER_SIZE) {
+        return false;
+    }
+
+    size_t pos = size - TRAILER_SIZE;
+    uint64_t indexOffset, blockCount;
+    readValue(data, size, pos, indexOffset);
+    readValue(data, size, pos, blockCount);
+    if (memcmp(data + pos, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || indexOffset > size - TRAILER_SIZE ||
+        blockCount != (size - TRAILER_SIZE - indexOffset) / ENTRY_SIZE) {
+        return false;
+    }
+    if (blockCount == 0) {
+        result = 0;
+        return true;
+    }
+
+    // The last entry's raw offset and size give the total
+    uint64_t rawOffset = 0;
+    uint32_t rawSize = 0;
+    pos = size_t(indexOffset) + size_t(blockCount - 1) * ENTRY_SIZE + sizeof(uint64_t);
+    readValue(data, size, pos, rawOffset);
+    readValue(data, size, pos, rawSize);
+    result = rawOffset + rawSize;
+    return true;
+}
+
+bool BlockCoder::compressFile(const string& inputFile, const string& outputFile) {
+    try {
+        // Store original file extension
+        fs::path inputPath(inputFile);
+        originalFileExtension = inputPath.extension().string();
+
+        ifstream inFile(inputFile, ios::binary);
+        ofstream outFile(outputFile, ios::binary);
+        if (!inFile || !outFile) {
+            return false;
+        }
+        return compressStream(inFile, outFile, originalFileExtension);
+    }
+    catch (const std::exception& e) {
+        cerr << "Compression error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool BlockCoder::decompressFile(const string& inputFile, const string& outputFile) {
+    try {
+        ifstream inFile(inputFile, ios::binary);
+        ofstream outFile(outputFile, ios::binary);
+        if (!inFile || !outFile) {
+            return false;
+        }
+
+        string extension;
+        if (readStreamHeader(inFile, extension)) {
+            inFile.seekg(0);
+            return decompressStream(inFile, outFile);
+        }
+        inFile.clear();
+        inFile.seekg(0);
+        return decompressLegacy(inFile, outFile);
+    }
+    catch (const std::exception& e) {
+        cerr << "Decompression error: " << e.what() << endl;
+        return false;
+    }
+}
+
+void CompressContext::begin(const string& extension) {
+    block.resize(coder.getBlockSize());
+    blockFill = 0;
+    pending.resize(BlockCoder::streamHeaderSize(extension));
+    BlockCoder::storeStreamHeader(pending.data(), extension);
+    pendingPos = 0;
+    index.start(pending.size());
+    streamCrc = 0;
+    ended = false;
+    failed = false;
+}
+
+bool CompressContext::codeBlock(const unsigned char* data, size_t size) {
+    compact();
+    body.clear();
+    BlockFrame frame;
+    if (!coder.compressFrame(data, size, body, frame)) {
+        failed = true;
+        return false;
+    }
+
+    size_t pos = pending.size();
+    size_t frameSize = frameHeaderSize(STREAM_VERSION);
+    pending.resize(pos + frameSize + body.size());
+    BlockCoder::storeFrame(&pending[pos], frame);
+    memcpy(&pending[pos + frameSize], body.data(), body.size());
+    index.add(size, body.size());
+    streamCrc = crc32cCombine(streamCrc, frame.rawCrc, size);
+    return true;
+}
+
+bool CompressContext::push(const unsigned char* data, size_t size, size_t& consumed) {
+    consumed = 0;
+    if (ended || failed) {
+        return false;
+    }
+    while (consumed < size && blockFill < block.size()) {
+        size_t take = min(block.size() - blockFill, size - consumed);
+
+        // A whole block in the caller's buffer is coded where it lies
+        if (blockFill == 0 && take == block.size() && drained()) {
+            if (!codeBlock(data + consumed, take)) {
+                return false;
+            }
+            consumed += take;
+            continue;
+        }
+
+        memcpy(block.data() + blockFill, data + consumed, take);
+        blockFill += take;
+        consumed += take;
+        if (blockFill == block.size() && drained()) {
+            if (!codeBlock(block.data(), blockFill)) {
+                return false;
+            }
+            blockFill = 0;
+        }
+    }
+    return true;
+}
+
+bool CompressContext::end() {
+    if (ended || failed) {
+        return false;
+    }
+    if (blockFill > 0) {
+        if (!codeBlock(block.data(), blockFill)) {
+            return false;
+        }
+        blockFill = 0;
+    }
+
+    // End of stream marker and block index
+    compact();
+    body.clear();
+    size_t pos = pending.size();
+    size_t frameSize = frameHeaderSize(STREAM_VERSION);
+    pending.resize(pos + frameSize + index.storedSize());
+    BlockCoder::storeFrame(&pending[pos], BlockCoder::makeFrame(0, streamCrc, body));
+    index.store(&pending[pos + frameSize]);
+    ended = true;
+    return true;
+}
+
+size_t CompressContext::pull(unsigned char* out, size_t capacity) {
+    size_t count = min(capacity, pending.size() - pendingPos);
+    if (count > 0) {
+        memcpy(out, pending.data() + pendingPos, count);
+        pendingPos += count;
+    }
+
+    // A full block held back by unpulled output is coded now there is room
+    if (drained() && blockFill == block.size() && codeBlock(block.data(), blockFill)) {
+        blockFill = 0;
+    }
+    return count;
+}
+
+void DecompressContext::begin() {
+    part = PART_HEADER;
+    needed = BlockCoder::HEADER_SIZE;
+    input.clear();
+    version = 0;
+    streamCrc = 0;
+    block.clear();
+    blockPos = 0;
+    failed = false;
+}
+
+bool DecompressContext::takePart(const unsigned char* data) {
+    switch (part) {
+    case PART_HEADER: {
+        size_t extLen;
+        if (!BlockCoder::parseStreamHeader(data, version, extLen)) {
+            cerr << "Decompression error: not a FileZipper stream\n";
+            return false;
+        }
+        part = extLen > 0 ? PART_EXTENSION : PART_FRAME;
+        needed = extLen > 0 ? extLen : frameHeaderSize(version);
+        return true;
+    }
+    case PART_EXTENSION:
+        part = PART_FRAME;
+        needed = frameHeaderSize(version);
+        return true;
+    case PART_FRAME:
+        if (!BlockCoder::parseBlockHeader(data, version, frame)) {
+            return false;
+        }
+        if (frame.rawSize == 0) {
+            part = PART_TRAILER;
+            return BlockCoder::checkStreamEnd(frame, version, streamCrc);
+        }
+        if (frame.bodySize == 0) {
+            cerr << "Decompression error: corrupt block header\n";
+            return false;
+        }
+        part = PART_BODY;
+        needed = frame.bodySize;
+        return true;
+    case PART_BODY:
+        block.resize(frame.rawSize);
+        blockPos = 0;
+        if (!coder.decodeFrame(frame, data, block.data(), version, streamCrc)) {
+            return false;
+        }
+        part = PART_FRAME;
+        needed = frameHeaderSize(version);
+        return true;
+    default:
+        return true;
+    }
+}
+
+bool DecompressContext::push(const unsigned char* data, size_t size, size_t& consumed) {
+    consumed = 0;
+    if (failed) {
+        return false;
+    }
+    while (consumed < size && blockPos == block.size()) {
+        // The block index and anything after the end frame are not needed
+        if (part == PART_TRAILER) {
+            consumed = size;
+            break;
+        }
+
+        // A part that arrives whole is used where it lies
+        const unsigned char* partData;
+        if (input.empty() && size - consumed >= needed) {
+            partData = data + consumed;
+            consumed += needed;
+        } else {
+            size_t take = min(needed - input.size(), size - consumed);
+            input.insert(input.end(), data + consumed, data + consumed + take);
+            consumed += take;
+            if (input.size() < needed) {
+                break;
+            }
+            partData = input.data();
+        }
+        if (!takePart(partData)) {
+            failed = true;
+            return false;
+        }
+        input.clear();
+    }
+    return true;
+}
+
+size_t DecompressContext::pull(unsigned char* out, size_t capacity) {
+    size_t count = min(capacity, block.size() - blockPos);
+    if (count > 0) {
+        memcpy(out, block.data() + blockPos, count);
+        blockPos += count;
+    }
+    return count;
+}
+
+bool ParallelEngine::runPipeline(const function<bool(Slot&)>& readSlot,
+                                 const function<bool(Slot&, int)>& codeSlot,
+                                 const function<bool(Slot&)>& writeSlot, bool& cancelled) {
+    vector<Slot> slots(threadCount * 2);
+    ThreadPool pool(threadCount);
+
+    // Slots [written, read) hold blocks being coded or waiting to be written;
+    // the reader may run at most one ring ahead of the writer
+    mutex ringLock;
+    condition_variable ringChanged;
+    size_t readCount = 0;
+    size_t writtenCount = 0;
+    bool readerDone = false;
+    bool stopReading = false;
+    cancelled = false;
+
+    thread reader([&] {
+        while (true) {
+            Slot* slot;
+            {
+                unique_lock<mutex> lock(ringLock);
+                ringChanged.wait(lock, [&] { return stopReading || readCount - writtenCount < slots.size(); });
+                if (stopReading) {
+                    break;
+                }
+                slot = &slots[readCount % slots.size()];
+            }
+            if (progress && progress->isCancelled()) {
+                cancelled = true;
+                break;
+            }
+            if (!readSlot(*slot)) {
+                break;
+            }
+            slot->done = pool.submit([&codeSlot, slot](int worker) { return codeSlot(*slot, worker); });
+            {
+                lock_guard<mutex> lock(ringLock);
+                readCount++;
+            }
+            ringChanged.notify_all();
+        }
+        {
+            lock_guard<mutex> lock(ringLock);
+            readerDone = true;
+        }
+        ringChanged.notify_all();
+    });
+
+    // Write finished blocks in order on this thread; after a failure keep
+    // draining so every queued block is collected before the ring goes away
+    bool ok = true;
+    while (true) {
+        Slot* slot;
+        {
+            unique_lock<mutex> lock(ringLock);
+            ringChanged.wait(lock, [&] { return readerDone || writtenCount < readCount; });
+            if (writtenCount == readCount) {
+                break;
+            }
+            slot = &slots[writtenCount % slots.size()];
+        }
+        ok = slot->done.get() && ok;
+        ok = ok && writeSlot(*slot);
+        {
+            lock_guard<mutex> lock(ringLock);
+            writtenCount++;
+            stopReading = stopReading || !ok;
+        }
+        ringChanged.notify_all();
+    }
+    reader.join();
+    return ok;
+}
+
+bool ParallelEngine::compressStream(istream& in, ostream& out, const string& extension, uint64_t* contentHash) {
+    vector<unique_ptr<BlockCoder>> coders;
+    for (int i = 0; i < threadCount; i++) {
+        coders.push_back(createCoder());
+    }
+
+    auto start = chrono::steady_clock::now();
+    StageStats readerStats, writerStats;
+    lastStats = RunStats();
+    BlockIndex index;
+    index.start(BlockCoder::writeStreamHeader(out, extension));
+
+    XxHash64 hasher;
+    auto readSlot = [&](Slot& slot) {
+        StageTimer timer(&readerStats, STAGE_READ);
+        slot.input.resize(blockSize);
+        in.read(reinterpret_cast<char*>(slot.input.data()), blockSize);
+        slot.rawSize = size_t(in.gcount());
+        timer.addBytes(slot.rawSize);
+        if (contentHash) {
+            hasher.update(slot.input.data(), slot.rawSize);
+        }
+        return slot.rawSize > 0;
+    };
+    auto codeSlot = [&](Slot& slot, int worker) {
+        slot.output.clear();
+        if (!coders[worker]->compressBlock(slot.input.data(), slot.rawSize, slot.output)) {
+            return false;
+        }
+        StageTimer timer(&coders[worker]->getStageStats(), STAGE_CHECKSUM, slot.rawSize + slot.output.size());
+        slot.frame = BlockCoder::makeFrame(slot.rawSize, crc32c(0, slot.input.data(), slot.rawSize), slot.output);
+        return true;
+    };
+    uint32_t streamCrc = 0;
+    auto writeSlot = [&](Slot& slot) {
+        StageTimer timer(&writerStats, STAGE_WRITE, frameHeaderSize(STREAM_VERSION) + slot.output.size());
+        if (!BlockCoder::writeBlock(out, slot.frame, slot.output)) {
+            return false;
+        }
+        if (STATS_ENABLED) {
+            lastStats.blocks.push_back(BlockStat{ uint32_t(slot.rawSize), uint32_t(slot.output.size()) });
+        }
+        index.add(slot.rawSize, slot.output.size());
+        streamCrc = crc32cCombine(streamCrc, slot.frame.rawCrc, slot.rawSize);
+        if (progress) {
+            progress->add(slot.rawSize, frameHeaderSize(STREAM_VERSION) + slot.output.size());
+        }
+        return true;
+    };
+
+    bool cancelled;
+    bool ok = runPipeline(readSlot, codeSlot, writeSlot, cancelled);
+
+    vector<unsigned char> end;
+    BlockCoder::writeBlock(out, BlockCoder::makeFrame(0, streamCrc, end), end);
+    index.write(out);
+    out.flush();
+    finishStats(start, readerStats, writerStats, coders, true);
+    if (contentHash) {
+        *contentHash = hasher.digest();
+    }
+    if (cancelled) {
+        cerr << "Compression cancelled\n";
+        return false;
+    }
+    return ok && bool(out) && !in.bad();
+}
+
+void ParallelEngine::finishStats(chrono::steady_clock::time_point start, const StageStats& reader,
+                                 const StageStats& writer, const vector<unique_ptr<BlockCoder>>& coders,
+                                 bool compressing) {
+    if (!STATS_ENABLED) {
+        return;
+    }
+    lastStats.threads = threadCount;
+    lastStats.wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    lastStats.stages.merge(reader);
+    lastStats.stages.merge(writer);
+    for (const unique_ptr<BlockCoder>& coder : coders) {
+        lastStats.stages.merge(coder->getStageStats());
+    }
+    uint64_t raw = 0;
+    uint64_t coded = 0;
+    for (const BlockStat& block : lastStats.blocks) {
+        raw += block.rawSize;
+        coded += block.bodySize;
+    }
+    lastStats.bytesIn = compressing ? raw : coded;
+    lastStats.bytesOut = compressing ? coded : raw;
+}
+
+bool ParallelEngine::decodeStream(istream& in, ostream* out, bool decode, const char* label) {
+    string extension;
+    unsigned char version;
+    if (!BlockCoder::readStreamHeader(in, extension, version)) {
+        cerr << label << " error: not a FileZipper stream\n";
+        return false;
+    }
+    if (!decode && version < 4) {
+        cerr << label << " error: stream version " << int(version)
+             << " has no checksums; verify by decoding instead\n";
+        return false;
+    }
+
+    vector<unique_ptr<BlockCoder>> coders;
+    for (int i = 0; i < threadCount; i++) {
+        coders.push_back(createCoder());
+    }
+
+    // Read the next block frame into a slot; false at end of stream
+    auto start = chrono::steady_clock::now();
+    StageStats readerStats, writerStats;
+    lastStats = RunStats();
+    bool streamOk = true;
+    BlockFrame end = {};
+    auto readSlot = [&](Slot& slot) {
+        StageTimer timer(&readerStats, STAGE_READ);
+        if (!BlockCoder::readBlockHeader(in, version, slot.frame)) {
+            streamOk = false;
+            return false;
+        }
+        if (slot.frame.rawSize == 0) {
+            end = slot.frame;
+            return false;
+        }
+        slot.input.resize(slot.frame.bodySize);
+        in.read(reinterpret_cast<char*>(slot.input.data()), slot.input.size());
+        if (!in) {
+            cerr << label << " error: truncated stream\n";
+            streamOk = false;
+            return false;
+        }
+        timer.addBytes(frameHeaderSize(version) + slot.input.size());
+        slot.rawSize = slot.frame.rawSize;
+        return true;
+    };
+
+    // Workers record why a block failed instead of reporting it, so the
+    // writer can report the first bad block in stream order
+    auto codeSlot = [&](Slot& slot, int worker) {
+        StageStats& stats = coders[worker]->getStageStats();
+        slot.error = NULL;
+        bool intact;
+        {
+            StageTimer timer(&stats, STAGE_CHECKSUM, slot.input.size());
+            intact = BlockCoder::checkFrame(slot.frame, slot.input.data(), version);
+        }
+        if (!intact) {
+            slot.error = "checksum mismatch";
+            return true;
+        }
+        if (!decode) {
+            return true;
+        }
+        slot.output.resize(slot.rawSize);
+        if (!coders[worker]->decompressBlock(slot.input.data(), slot.input.size(),
+                                             slot.output.data(), slot.rawSize, version)) {
+            slot.error = "corrupt data";
+            return true;
+        }
+        StageTimer timer(&stats, STAGE_CHECKSUM, slot.rawSize);
+        if (version >= 4 && crc32c(0, slot.output.data(), slot.rawSize) != slot.frame.rawCrc) {
+            slot.error = "checksum mismatch";
+        }
+        return true;
+    };
+
+    uint64_t blockNumber = 0;
+    uint32_t streamCrc = 0;
+    auto writeSlot = [&](Slot& slot) {
+        if (slot.error) {
+            cerr << label << " error: " << slot.error << " in block " << blockNumber << "\n";
+            return false;
+        }
+        blockNumber++;
+        streamCrc = crc32cCombine(streamCrc, slot.frame.rawCrc, slot.rawSize);
+        if (STATS_ENABLED) {
+            lastStats.blocks.push_back(BlockStat{ uint32_t(slot.rawSize), uint32_t(slot.input.size()) });
+        }
+        if (out) {
+            StageTimer timer(&writerStats, STAGE_WRITE, slot.rawSize);
+            out->write(reinterpret_cast<const char*>(slot.output.data()), slot.rawSize);
+        }
+        if (progress) {
+            progress->add(frameHeaderSize(version) + slot.input.size(), slot.rawSize);
+        }
+        return !out || bool(*out);
+    };
+
+    bool cancelled;
+    bool ok = runPipeline(readSlot, codeSlot, writeSlot, cancelled);
+    if (out) {
+        out->flush();
+    }
+    finishStats(start, readerStats, writerStats, coders, false);
+    if (cancelled) {
+        cerr << label << " cancelled\n";
+        return false;
+    }
+    if (!ok || !streamOk) {
+        return false;
+    }
+
+    // The end frame carries the CRC of all the uncompressed data; the block
+    // CRCs combined must match it, which also catches dropped or reordered blocks
+    vector<unsigned char> empty;
+    if (version >= 4 && (!BlockCoder::checkFrame(end, empty.data(), version) || end.rawCrc != streamCrc)) {
+        cerr << label << " error: stream checksum mismatch\n";
+        return false;
+    }
+    return !out || bool(*out);
+}
+
+bool ParallelEngine::decompressStream(istream& in, ostream& out) {
+    return decodeStream(in, &out, true, "Decompression");
+}
+
+bool ParallelEngine::verifyStream(istream& in, bool fullDecode) {
+    return decodeStream(in, NULL, fullDecode, "Verify");
+}
+
+bool ParallelEngine::compressFile(const string& inputFile, const string& outputFile, uint64_t* contentHash) {
+    try {
+        ifstream inFile(inputFile, ios::binary);
+        ofstream outFile(outputFile, ios::binary);
+        if (!inFile || !outFile) {
+            return false;
+        }
+        return compressStream(inFile, outFile, fs::path(inputFile).extension().string(), contentHash);
+    }
+    catch (const std::exception& e) {
+        cerr << "Compression error: " << e.what() << endl;
+        return false;
+    }
+}
+
+// Helper function to check that a stream's block index, which the frame
+// checksums do not cover, points at consecutive frames of the right sizes
+static bool checkBlockIndex(istream& in) {
+    string extension;
+    unsigned char version;
+    vector<BlockIndexEntry> entries;
+    in.clear();
+    in.seekg(0);
+    if (!BlockCoder::readStreamHeader(in, extension, version)) {
+        return false;
+    }
+    uint64_t next = uint64_t(in.tellg());
+    if (!BlockIndex::read(in, entries)) {
+        return false;
+    }
+
+    BlockFrame frame;
+    for (const BlockIndexEntry& entry : entries) {
+        in.seekg(streamoff(entry.compressedOffset));
+        if (entry.compressedOffset != next || !BlockCoder::readBlockHeader(in, version, frame) ||
+            frame.rawSize != entry.rawSize) {
+            return false;
+        }
+        next += frameHeaderSize(version) + frame.bodySize;
+    }
+    in.seekg(streamoff(next));
+    return BlockCoder::readBlockHeader(in, version, frame) && frame.rawSize == 0;
+}
+
+bool ParallelEngine::verifyFile(const string& inputFile, bool fullDecode) {
+    try {
+        ifstream inFile(inputFile, ios::binary);
+        if (!inFile || !verifyStream(inFile, fullDecode)) {
+            return false;
+        }
+        if (!checkBlockIndex(inFile)) {
+            cerr << "Verify error: block index does not match stream\n";
+            return false;
+        }
+        return true;
+    }
+    catch (const std::exception& e) {
+        cerr << "Verify error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool ParallelEngine::decompressFile(const string& inputFile, const string& outputFile) {
+    try {
+        ifstream inFile(inputFile, ios::binary);
+        string extension;
+        if (!BlockCoder::readStreamHeader(inFile, extension)) {
+            inFile.close();
+            BlockCoder coder;
+            return coder.decompressFile(inputFile, outputFile);
+        }
+        inFile.seekg(0);
+
+        ofstream outFile(outputFile, ios::binary);
+        if (!outFile) {
+            return false;
+        }
+        return decompressStream(inFile, outFile);
+    }
+    catch (const std::exception& e) {
+        cerr << "Decompression error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool FileArchive::isSafeName(const string& name) {
+    fs::path path(name);
+    if (name.empty() || path.is_absolute() || path.has_root_name()) {
+        return false;
+    }
+    for (const fs::path& part : path) {
+        if (part == "..") {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FileArchive::writeDirectory(ostream& out, const vector<ArchiveEntry>& entries) {
+    uint64_t directoryOffset = uint64_t(out.tellp());
+    vector<unsigned char> data;
+    for (const ArchiveEntry& entry : entries) {
+        appendValue<uint16_t>(data, uint16_t(entry.name.size()));
+        data.insert(data.end(), entry.name.begin(), entry.name.end());
+        appendValue<uint64_t>(data, entry.originalSize);
+        appendValue<uint64_t>(data, entry.compressedSize);
+        appendValue<uint64_t>(data, entry.offset);
+        appendValue<int64_t>(data, entry.modifiedTime);
+    }
+    appendValue<uint64_t>(data, directoryOffset);
+    appendValue<uint64_t>(data, uint64_t(entries.size()));
+    data.insert(data.end(), DIRECTORY_MAGIC, DIRECTORY_MAGIC + sizeof(DIRECTORY_MAGIC));
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    return bool(out);
+}
+
+bool FileArchive::create(const string& directory, const string& archivePath) {
+    try {
+        // An archive written inside the directory must not archive itself
+        vector<fs::path> files;
+        for (const auto& item : fs::recursive_directory_iterator(directory)) {
+            error_code error;
+            if (item.is_regular_file() && !fs::equivalent(item.path(), archivePath, error)) {
+                files.push_back(item.path());
+            }
+        }
+
+        vector<ArchiveEntry> entries(files.size());
+        for (size_t i = 0; i < files.size(); i++) {
+            entries[i].name = fs::relative(files[i], directory).generic_string();
+            if (entries[i].name.size() > UINT16_MAX) {
+                cerr << "Archive error: path too long to store: " << entries[i].name.substr(0, 64) << "...\n";
+                return false;
+            }
+            entries[i].originalSize = fs::file_size(files[i]);
+            entries[i].modifiedTime = toUnixTime(fs::last_write_time(files[i]));
+        }
+
+        // Sorted names let readers binary-search the directory
+        vector<size_t> order(files.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+        sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return entries[a].name < entries[b].name;
+        });
+
+        ofstream out(archivePath, ios::binary);
+        if (!out) {
+            return false;
+        }
+        out.write(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+        out.write(reinterpret_cast<const char*>(&ARCHIVE_VERSION), sizeof(ARCHIVE_VERSION));
+
+        const int threadCount = engine.getThreadCount();
+        vector<unique_ptr<BlockCoder>> coders;
+        for (int i = 0; i < threadCount; i++) {
+            coders.push_back(engine.createCoder());
+        }
+
+        // Small entries are compressed into memory ahead of the writer, at
+        // most window of them at a time. The pool is declared last so it is
+        // joined before anything its tasks touch is destroyed.
+        vector<string> buffers(files.size());
+        vector<future<bool>> pending(files.size());
+        const size_t window = size_t(threadCount) * 4;
+        const uint64_t smallLimit = uint64_t(engine.getBlockSize()) * SMALL_FILE_BLOCKS;
+        ThreadPool pool(threadCount);
+
+        size_t submitted = 0;
+        auto submitUpTo = [&](size_t limit) {
+            for (; submitted < min(limit, order.size()); submitted++) {
+                size_t index = order[submitted];
+                if (entries[index].originalSize > smallLimit) {
+                    continue;
+                }
+                pending[index] = pool.submit([&, index](int worker) {
+                    ifstream in(files[index], ios::binary);
+                    ostringstream compressed;
+                    bool ok = in && coders[worker]->compressStream(in, compressed, files[index].extension().string());
+                    buffers[index] = compressed.str();
+                    return ok;
+                });
+            }
+        };
+
+        bool ok = true;
+        for (size_t i = 0; i < order.size(); i++) {
+            submitUpTo(i + window);
+            size_t index = order[i];
+            ArchiveEntry& entry = entries[index];
+            entry.offset = uint64_t(out.tellp());
+
+            if (pending[index].valid()) {
+                if (!pending[index].get()) {
+                    cerr << "Archive error: cannot compress " << entry.name << "\n";
+                    ok = false;
+                }
+                out.write(buffers[index].data(), buffers[index].size());
+                string().swap(buffers[index]);
+            } else {
+                ifstream in(files[index], ios::binary);
+                if (!in || !engine.compressStream(in, out, files[index].extension().string())) {
+                    cerr << "Archive error: cannot compress " << entry.name << "\n";
+                    ok = false;
+                }
+            }
+            entry.compressedSize = uint64_t(out.tellp()) - entry.offset;
+            if (!ok || !out) {
+                return false;   // The pool is joined before the buffers it writes are freed
+            }
+        }
+
+        vector<ArchiveEntry> sorted;
+        for (size_t index : order) {
+            sorted.push_back(entries[index]);
+        }
+        return writeDirectory(out, sorted);
+    }
+    catch (const std::exception& e) {
+        cerr << "Archive error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool FileArchive::list(const string& archivePath, vector<ArchiveEntry>& entries) {
+    ifstream in(archivePath, ios::binary);
+    in.seekg(0, ios::end);
+    streamoff fileSize = in.tellg();
+    const size_t trailerSize = 20;
+    if (!in || fileSize < streamoff(sizeof(ARCHIVE_MAGIC) + 1 + trailerSize)) {
+        return false;
+    }
+
+    unsigned char trailer[trailerSize];
+    in.seekg(fileSize - streamoff(trailerSize));
+    in.read(reinterpret_cast<char*>(trailer), trailerSize);
+    size_t pos = 0;
+    uint64_t directoryOffset, entryCount;
+    readValue(trailer, trailerSize, pos, directoryOffset);
+    readValue(trailer, trailerSize, pos, entryCount);
+    if (!in || memcmp(trailer + pos, DIRECTORY_MAGIC, sizeof(DIRECTORY_MAGIC)) != 0 ||
+        directoryOffset > uint64_t(fileSize) - trailerSize) {
+        return false;
+    }
+
+    vector<unsigned char> data(size_t(uint64_t(fileSize) - trailerSize - directoryOffset));
+    in.seekg(streamoff(directoryOffset));
+    in.read(reinterpret_cast<char*>(data.data()), data.size());
+    if (!in) {
+        return false;
+    }
+
+    entries.clear();
+    pos = 0;
+    for (uint64_t i = 0; i < entryCount; i++) {
+        ArchiveEntry entry;
+        uint16_t nameLength;
+        if (!readValue(data.data(), data.size(), pos, nameLength) || data.size() - pos < nameLength) {
+            return false;
+        }
+        entry.name.assign(reinterpret_cast<const char*>(&data[pos]), nameLength);
+        pos += nameLength;
+        if (!readValue(data.data(), data.size(), pos, entry.originalSize) ||
+            !readValue(data.data(), data.size(), pos, entry.compressedSize) ||
+            !readValue(data.data(), data.size(), pos, entry.offset) ||
+            !readValue(data.data(), data.size(), pos, entry.modifiedTime) ||
+            entry.offset + entry.compressedSize > directoryOffset) {
+            return false;
+        }
+        entries.push_back(entry);
+    }
+    return pos == data.size();
+}
+
+bool FileArchive::extract(const string& archivePath, const string& name, const string& outputPath) {
+    vector<ArchiveEntry> entries;
+    if (!list(archivePath, entries)) {
+        cerr << "Archive error: cannot read directory of " << archivePath << "\n";
+        return false;
+    }
+    auto it = lower_bound(entries.begin(), entries.end(), name,
+        [](const ArchiveEntry& entry, const string& value) { return entry.name < value; });
+    if (it == entries.end() || it->name != name) {
+        cerr << "Archive error: no entry named " << name << "\n";
+        return false;
+    }
+    return extractEntry(archivePath, *it, outputPath);
+}
+
+bool FileArchive::extractAll(const string& archivePath, const string& outputDirectory) {
+    vector<ArchiveEntry> entries;
+    if (!list(archivePath, entries)) {
+        cerr << "Archive error: cannot read directory of " << archivePath << "\n";
+        return false;
+    }
+    for (const ArchiveEntry& entry : entries) {
+        if (!isSafeName(entry.name)) {
+            cerr << "Archive error: unsafe entry name " << entry.name << "\n";
+            return false;
+        }
+        if (!extractEntry(archivePath, entry, (fs::path(outputDirectory) / entry.name).string())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FileArchive::verify(const string& archivePath, bool fullDecode) {
+    vector<ArchiveEntry> entries;
+    if (!list(archivePath, entries)) {
+        cerr << "Archive error: cannot read directory of " << archivePath << "\n";
+        return false;
+    }
+    try {
+        ifstream in(archivePath, ios::binary);
+        bool ok = bool(in);
+        for (const ArchiveEntry& entry : entries) {
+            in.clear();
+            in.seekg(streamoff(entry.offset));
+            if (!engine.verifyStream(in, fullDecode)) {
+                cerr << "Archive error: " << entry.name << " failed verification\n";
+                ok = false;
+            }
+        }
+        return ok;
+    }
+    catch (const std::exception& e) {
+        cerr << "Archive error: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool FileArchive::extractEntry(const string& archivePath, const ArchiveEntry& entry, const string& outputPath) {
+    try {
+        ifstream in(archivePath, ios::binary);
+        fs::path target(outputPath);
+        if (target.has_parent_path()) {
+            fs::create_directories(target.parent_path());
+        }
+        ofstream out(outputPath, ios::binary);
+        if (!in || !out) {
+            return false;
+        }
+
+        in.seekg(streamoff(entry.offset));
+        if (!engine.decompressStream(in, out)) {
+            cerr << "Archive error: cannot extract " << entry.name << "\n";
+            return false;
+        }
+        out.close();
+        fs::last_write_time(target, fromUnixTime(entry.modifiedTime));
+        return true;
+    }
+    catch (const std::exception& e) {
+        cerr << "Archive error: " << e.what() << endl;
+        return false;
+    }
+}
+
+void HistoryStore::KeyIndex::insert(uint64_t key, uint32_t record) {
+    Entry entry{ key, record };
+    recent.insert(upper_bound(recent.begin(), recent.end(), entry), entry);
+    if (recent.size() > 64 && recent.size() * recent.size() > sorted.size()) {
+        size_t middle = sorted.size();
+        sorted.insert(sorted.end(), recent.begin(), recent.end());
+        inplace_merge(sorted.begin(), sorted.begin() + middle, sorted.end());
+        recent.clear();
+    }
+}
+
+void HistoryStore::KeyIndex::find(uint64_t key, vector<uint32_t>& result) const {
+    result.clear();
+    for (const vector<Entry>* run : { &sorted, &recent }) {
+        auto it = lower_bound(run->begin(), run->end(), Entry{ key, 0 });
+        for (; it != run->end() && it->key == key; ++it) {
+            result.push_back(it->record);
+        }
+    }
+    sort(result.begin(), result.end(), greater<uint32_t>());
+}
+
+// Helper function to encode a record payload
+static vector<unsigned char> encodeHistoryRecord(const HistoryRecord& record) {
+    vector<unsigned char> payload;
+    appendValue<uint8_t>(payload, uint8_t(record.operation));
+    appendValue<uint64_t>(payload, record.contentHash);
+    appendValue<uint64_t>(payload, record.inputSize);
+    appendValue<int64_t>(payload, record.inputModified);
+    appendValue<uint64_t>(payload, record.outputSize);
+    appendValue<int64_t>(payload, record.outputModified);
+    appendValue<uint64_t>(payload, record.settings);
+    appendValue<int64_t>(payload, record.time);
+    for (const string* path : { &record.inputPath, &record.outputPath }) {
+        appendValue<uint16_t>(payload, uint16_t(path->size()));
+        payload.insert(payload.end(), path->begin(), path->end());
+    }
+    return payload;
+}
+
+// Helper function to decode a record payload; false if it is malformed
+static bool decodeHistoryRecord(const vector<unsigned char>& payload, HistoryRecord& record) {
+    const unsigned char* data = payload.data();
+    size_t size = payload.size();
+    size_t pos = 0;
+    uint8_t operation;
+    if (!readValue(data, size, pos, operation) || operation > HISTORY_DECOMPRESS ||
+        !readValue(data, size, pos, record.contentHash) ||
+        !readValue(data, size, pos, record.inputSize) ||
+        !readValue(data, size, pos, record.inputModified) ||
+        !readValue(data, size, pos, record.outputSize) ||
+        !readValue(data, size, pos, record.outputModified) ||
+        !readValue(data, size, pos, record.settings) ||
+        !readValue(data, size, pos, record.time)) {
+        return false;
+    }
+    record.operation = HistoryOperation(operation);
+    for (string* path : { &record.inputPath, &record.outputPath }) {
+        uint16_t length;
+        if (!readValue(data, size, pos, length) || size - pos < length) {
+            return false;
+        }
+        path->assign(reinterpret_cast<const char*>(data + pos), length);
+        pos += length;
+    }
+    return pos == size;
+}
+
+bool HistoryStore::open(const string& path) {
+    lock_guard<mutex> lock(storeLock);
+    log.close();
+    records.clear();
+    pathIndex.clear();
+    contentIndex.clear();
+    sizeIndex.clear();
+    logPath = path;
+
+    // Load every intact record; anything after the first bad one is a torn write
+    uint64_t goodSize = 0;
+    {
+        ifstream in(path, ios::binary);
+        char magic[sizeof(HISTORY_MAGIC)];
+        unsigned char version = 0;
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char*>(&version), sizeof(version));
+        if (in && (memcmp(magic, HISTORY_MAGIC, sizeof(magic)) != 0 || version != HISTORY_VERSION)) {
+            cerr << "History error: " << path << " is not a history store\n";
+            return false;
+        }
+        if (in) {
+            goodSize = sizeof(HISTORY_MAGIC) + sizeof(HISTORY_VERSION);
+        }
+
+        vector<unsigned char> payload;
+        HistoryRecord record;
+        while (in) {
+            uint32_t payloadSize, crc;
+            if (!in.read(reinterpret_cast<char*>(&payloadSize), sizeof(payloadSize)) || payloadSize > (1 << 20)) {
+                break;
+            }
+            payload.resize(payloadSize);
+            in.read(reinterpret_cast<char*>(payload.data()), payloadSize);
+            in.read(reinterpret_cast<char*>(&crc), sizeof(crc));
+            if (!in || crc != crc32c(0, payload.data(), payload.size()) || !decodeHistoryRecord(payload, record)) {
+                break;
+            }
+            uint32_t number = uint32_t(records.size());
+            records.push_back(record);
+            pathIndex.load(pathKey(record.inputPath), number);
+            if (record.operation == HISTORY_COMPRESS) {
+                contentIndex.load(record.contentHash, number);
+                sizeIndex.load(sizeKey(record.inputSize, record.settings), number);
+            }
+            goodSize += sizeof(payloadSize) + payloadSize + sizeof(crc);
+        }
+    }
+    pathIndex.finishLoading();
+    contentIndex.finishLoading();
+    sizeIndex.finishLoading();
+
+    error_code error;
+    if (goodSize == 0) {
+        ofstream create(path, ios::binary | ios::trunc);
+        create.write(HISTORY_MAGIC, sizeof(HISTORY_MAGIC));
+        create.write(reinterpret_cast<const char*>(&HISTORY_VERSION), sizeof(HISTORY_VERSION));
+        if (!create) {
+            cerr << "History error: cannot create " << path << "\n";
+            return false;
+        }
+    } else if (fs::file_size(path, error) != goodSize && !error) {
+        fs::resize_file(path, goodSize, error);
+    }
+    if (error) {
+        cerr << "History error: " << error.message() << "\n";
+        return false;
+    }
+
+    log.open(path, ios::binary | ios::app);
+    return bool(log);
+}
+
+size_t HistoryStore::size() const {
+    lock_guard<mutex> lock(storeLock);
+    return records.size();
+}
+
+string HistoryStore::normalizePath(const string& path) {
+    error_code error;
+    fs::path absolute = fs::absolute(path, error);
+    return (error ? fs::path(path) : absolute).lexically_normal().string();
+}
+
+bool HistoryStore::hashFile(const string& path, uint64_t& hash) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        return false;
+    }
+    XxHash64 hasher;
+    vector<unsigned char> chunk(DEFAULT_BLOCK_SIZE);
+    while (in) {
+        in.read(reinterpret_cast<char*>(chunk.data()), chunk.size());
+        hasher.update(chunk.data(), size_t(in.gcount()));
+    }
+    hash = hasher.digest();
+    return !in.bad();
+}
+
+bool HistoryStore::statFile(const string& path, uint64_t& size, int64_t& modified) {
+    error_code error;
+    uintmax_t fileSize = fs::file_size(path, error);
+    if (error) {
+        return false;
+    }
+    fs::file_time_type time = fs::last_write_time(path, error);
+    if (error) {
+        return false;
+    }
+    size = uint64_t(fileSize);
+    modified = int64_t(time.time_since_epoch().count());
+    return true;
+}
+
+bool HistoryStore::outputIntact(const HistoryRecord& record) {
+    uint64_t size;
+    int64_t modified;
+    return statFile(record.outputPath, size, modified) &&
+           size == record.outputSize && modified == record.outputModified;
+}
+
+void HistoryStore::addRecord(const HistoryRecord& record) {
+    uint32_t number = uint32_t(records.size());
+    records.push_back(record);
+    pathIndex.insert(pathKey(record.inputPath), number);
+    if (record.operation == HISTORY_COMPRESS) {
+        contentIndex.insert(record.contentHash, number);
+        sizeIndex.insert(sizeKey(record.inputSize, record.settings), number);
+    }
+}
+
+bool HistoryStore::appendRecord(const HistoryRecord& record) {
+    if (!log.is_open() || record.inputPath.size() > UINT16_MAX || record.outputPath.size() > UINT16_MAX) {
+        return false;
+    }
+    vector<unsigned char> payload = encodeHistoryRecord(record);
+    uint32_t payloadSize = uint32_t(payload.size());
+    uint32_t crc = crc32c(0, payload.data(), payload.size());
+    log.write(reinterpret_cast<const char*>(&payloadSize), sizeof(payloadSize));
+    log.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+    log.write(reinterpret_cast<const char*>(&crc), sizeof(crc));
+    log.flush();
+    if (!log) {
+        cerr << "History error: cannot write " << logPath << "\n";
+        return false;
+    }
+    addRecord(record);
+    return true;
+}
+
+vector<HistoryRecord> HistoryStore::findByPath(const string& inputPath) const {
+    string path = normalizePath(inputPath);
+    lock_guard<mutex> lock(storeLock);
+    vector<uint32_t> numbers;
+    pathIndex.find(pathKey(path), numbers);
+    vector<HistoryRecord> result;
+    for (uint32_t number : numbers) {
+        if (records[number].inputPath == path) {
+            result.push_back(records[number]);
+        }
+    }
+    return result;
+}
+
+vector<HistoryRecord> HistoryStore::findByContent(uint64_t contentHash) const {
+    lock_guard<mutex> lock(storeLock);
+    vector<uint32_t> numbers;
+    contentIndex.find(contentHash, numbers);
+    vector<HistoryRecord> result;
+    for (uint32_t number : numbers) {
+        result.push_back(records[number]);
+    }
+    return result;
+}
+
+bool HistoryStore::reuseCompressed(const string& inputFile, const string& outputFile, uint64_t settings,
+                                   HistoryRecord& record) {
+    record = HistoryRecord();
+    record.operation = HISTORY_COMPRESS;
+    record.inputPath = normalizePath(inputFile);
+    record.outputPath = normalizePath(outputFile);
+    record.settings = settings;
+    if (!statFile(record.inputPath, record.inputSize, record.inputModified)) {
+        return false;
+    }
+
+    // Cheap check first: same input path, size and mtime, output untouched.
+    // Candidates are copied out so outputs are checked without the lock held.
+    vector<uint32_t> numbers;
+    vector<HistoryRecord> candidates;
+    {
+        lock_guard<mutex> lock(storeLock);
+        pathIndex.find(pathKey(record.inputPath), numbers);
+        for (uint32_t number : numbers) {
+            const HistoryRecord& old = records[number];
+            if (old.operation == HISTORY_COMPRESS && old.inputPath == record.inputPath &&
+                old.outputPath == record.outputPath && old.settings == settings &&
+                old.inputSize == record.inputSize && old.inputModified == record.inputModified) {
+                candidates.push_back(old);
+            }
+        }
+    }
+    for (const HistoryRecord& old : candidates) {
+        if (outputIntact(old)) {
+            return true;
+        }
+    }
+
+    // Hashing reads the whole input, so leave it to the compression unless
+    // an earlier run compressed an input of this size with these settings
+    bool candidate = false;
+    {
+        lock_guard<mutex> lock(storeLock);
+        sizeIndex.find(sizeKey(record.inputSize, settings), numbers);
+        for (uint32_t number : numbers) {
+            if (records[number].inputSize == record.inputSize && records[number].settings == settings) {
+                candidate = true;
+                break;
+            }
+        }
+    }
+    if (!candidate) {
+        return false;
+    }
+
+    // Otherwise hash the content and look for an intact output of the same
+    // bytes, compressed with the same settings from an input with the same
+    // extension (the extension is stored in the stream header)
+    if (!hashFile(record.inputPath, record.contentHash)) {
+        record.contentHash = 0;
+        return false;
+    }
+    candidates.clear();
+    {
+        lock_guard<mutex> lock(storeLock);
+        contentIndex.find(record.contentHash, numbers);
+        for (uint32_t number : numbers) {
+            const HistoryRecord& old = records[number];
+            if (old.inputSize == record.inputSize && old.settings == settings &&
+                fs::path(old.inputPath).extension() == fs::path(record.inputPath).extension()) {
+                candidates.push_back(old);
+            }
+        }
+    }
+    const HistoryRecord* match = NULL;
+    for (const HistoryRecord& old : candidates) {
+        if (outputIntact(old)) {
+            match = &old;
+            break;
+        }
+    }
+    if (!match) {
+        return false;
+    }
+
+    error_code error;
+    if (match->outputPath != record.outputPath &&
+        !fs::copy_file(match->outputPath, record.outputPath, fs::copy_options::overwrite_existing, error)) {
+        return false;
+    }
+    // Record the new path or mtime so the next run takes the cheap check
+    return recordCompressed(record);
+}
+
+bool HistoryStore::recordCompressed(HistoryRecord& record) {
+    if (!statFile(record.outputPath, record.outputSize, record.outputModified)) {
+        return false;
+    }
+    record.time = int64_t(time(NULL));
+    lock_guard<mutex> lock(storeLock);
+    return appendRecord(record);
+}
+
+bool HistoryStore::recordDecompressed(const string& inputFile, const string& outputFile) {
+    HistoryRecord record = HistoryRecord();
+    record.operation = HISTORY_DECOMPRESS;
+    record.inputPath = normalizePath(inputFile);
+    record.outputPath = normalizePath(outputFile);
+    if (!statFile(record.inputPath, record.inputSize, record.inputModified) ||
+        !statFile(record.outputPath, record.outputSize, record.outputModified)) {
+        return false;
+    }
+    record.time = int64_t(time(NULL));
+    lock_guard<mutex> lock(storeLock);
+    return appendRecord(record);
+}
+
+const char* RunStats::bottleneck() const {
+    double io = max(stages.stages[STAGE_READ].wallSeconds, stages.stages[STAGE_WRITE].wallSeconds);
+    double coding = 0.0;
+    for (int i = STAGE_HISTOGRAM; i <= STAGE_CHECKSUM; i++) {
+        coding += stages.stages[i].wallSeconds;
+    }
+    return io > coding / max(threads, 1) ? "io" : "cpu";
+}
+
+void RunStats::writeJson(ostream& out) const {
+    ostringstream json;
+    json << fixed << setprecision(6);
+    json << "{\n"
+         << "  \"enabled\": " << (STATS_ENABLED ? "true" : "false") << ",\n"
+         << "  \"threads\": " << threads << ",\n"
+         << "  \"wall_seconds\": " << wallSeconds << ",\n"
+         << "  \"bytes_in\": " << bytesIn << ",\n"
+         << "  \"bytes_out\": " << bytesOut << ",\n"
+         << "  \"bound\": \"" << bottleneck() << "\",\n"
+         << "  \"stages\": {\n";
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const StageCounter& stage = stages.stages[i];
+        double mbps = stage.wallSeconds > 0.0 ? stage.bytes / stage.wallSeconds / (1 << 20) : 0.0;
+        json << "    \"" << STAGE_NAMES[i] << "\": {\"calls\": " << stage.calls << ", \"bytes\": " << stage.bytes
+             << ", \"wall_seconds\": " << stage.wallSeconds << ", \"cpu_seconds\": " << stage.cpuSeconds
+             << ", \"mb_per_s\": " << setprecision(1) << mbps << setprecision(6) << "}"
+             << (i + 1 < STAGE_COUNT ? ",\n" : "\n");
+    }
+    json << "  },\n" << setprecision(3);
+
+    // Ratio is original over compressed size, as in filezipper_bench
+    double minRatio = 0.0, maxRatio = 0.0, totalRatio = 0.0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        double ratio = blocks[i].bodySize ? double(blocks[i].rawSize) / blocks[i].bodySize : 0.0;
+        minRatio = i ? min(minRatio, ratio) : ratio;
+        maxRatio = max(maxRatio, ratio);
+        totalRatio += ratio;
+    }
+    json << "  \"blocks\": {\"count\": " << blocks.size() << ", \"min_ratio\": " << minRatio
+         << ", \"mean_ratio\": " << (blocks.empty() ? 0.0 : totalRatio / blocks.size())
+         << ", \"max_ratio\": " << maxRatio << ", \"ratios\": [";
+    for (size_t i = 0; i < blocks.size(); i++) {
+        json << (i ? ", " : "") << (blocks[i].bodySize ? double(blocks[i].rawSize) / blocks[i].bodySize : 0.0);
+    }
+    json << "]}\n}\n";
+    out << json.str();
+}
+
+JobStatus JobQueue::snapshot(const Job& job) {
+    JobStatus status = job.status;
+    status.bytesIn = job.progress.getBytesIn();
+    status.bytesOut = job.progress.getBytesOut();
+    if (status.state == JOB_RUNNING) {
+        status.elapsedSeconds = chrono::duration<double>(chrono::steady_clock::now() - job.started).count();
+    }
+    status.mbps = 0.0;
+    status.etaSeconds = -1.0;
+    if (status.elapsedSeconds > 0.0 && status.bytesIn > 0) {
+        double bytesPerSecond = status.bytesIn / status.elapsedSeconds;
+        status.mbps = bytesPerSecond / (1 << 20);
+        if (status.state == JOB_RUNNING) {
+            uint64_t remaining = status.totalBytes > status.bytesIn ? status.totalBytes - status.bytesIn : 0;
+            status.etaSeconds = remaining / bytesPerSecond;
+        } else if (status.state == JOB_DONE) {
+            status.etaSeconds = 0.0;
+        }
+    }
+    return status;
+}
+
+JobQueue::JobQueue(int concurrency) : history(NULL), stopping(false) {
+    for (int i = 0; i < max(concurrency, 1); i++) {
+        runners.emplace_back(&JobQueue::runnerLoop, this);
+    }
+}
+
+JobQueue::~JobQueue() {
+    cancelAll();
+    {
+        lock_guard<mutex> lock(jobLock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (thread& runner : runners) {
+        runner.join();
+    }
+}
+
+void JobQueue::runnerLoop() {
+    while (true) {
+        Job* job;
+        {
+            unique_lock<mutex> lock(jobLock);
+            changed.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            job = findJob(pending.front());
+            pending.pop_front();
+            job->status.state = JOB_RUNNING;
+            job->started = chrono::steady_clock::now();
+        }
+        changed.notify_all();
+
+        if (callback) {
+            job->progress.setCallback([this, job](uint64_t, uint64_t) {
+                JobStatus status;
+                {
+                    lock_guard<mutex> lock(jobLock);
+                    status = snapshot(*job);
+                }
+                callback(status);
+            });
+        }
+        job->engine.setProgress(&job->progress);
+        bool ok;
+        bool reused = false;
+        HistoryRecord record;
+        switch (job->status.type) {
+        case JOB_COMPRESS:
+            reused = history && history->reuseCompressed(job->status.input, job->status.output,
+                                                         job->engine.getSettingsKey(), record);
+            if (reused) {
+                error_code ignored;
+                job->progress.add(job->status.totalBytes, uint64_t(fs::file_size(job->status.output, ignored)));
+            }
+            // Unless reuseCompressed already hashed the input, hash it while compressing
+            ok = reused || job->engine.compressFile(job->status.input, job->status.output,
+                                                    history && record.contentHash == 0 ? &record.contentHash
+                                                                                       : NULL);
+            if (ok && !reused && history) {
+                history->recordCompressed(record);
+            }
+            break;
+        case JOB_DECOMPRESS:
+            ok = job->engine.decompressFile(job->status.input, job->status.output);
+            if (ok && history) {
+                history->recordDecompressed(job->status.input, job->status.output);
+            }
+            break;
+        default:
+            ok = job->engine.verifyFile(job->status.input, job->status.type == JOB_VERIFY_FULL);
+            break;
+        }
+        if (!ok && !job->status.output.empty()) {
+            error_code ignored;
+            fs::remove(job->status.output, ignored);
+        }
+
+        JobStatus result;
+        {
+            lock_guard<mutex> lock(jobLock);
+            job->status.elapsedSeconds =
+                chrono::duration<double>(chrono::steady_clock::now() - job->started).count();
+            job->status.state = ok ? JOB_DONE : job->progress.isCancelled() ? JOB_CANCELLED : JOB_FAILED;
+            job->status.reused = reused;
+            result = snapshot(*job);
+        }
+        changed.notify_all();
+        if (callback) {
+            callback(result);
+        }
+    }
+}
+
+int JobQueue::submit(JobType type, const string& input, const string& output) {
+    unique_ptr<Job> job(new Job());
+    job->status.type = type;
+    job->status.state = JOB_QUEUED;
+    job->status.input = input;
+    job->status.output = output;
+    job->status.bytesIn = 0;
+    job->status.bytesOut = 0;
+    error_code error;
+    uintmax_t size = fs::file_size(input, error);
+    job->status.totalBytes = error ? 0 : uint64_t(size);
+    job->status.elapsedSeconds = 0.0;
+    job->status.mbps = 0.0;
+    job->status.etaSeconds = -1.0;
+    job->status.reused = false;
+
+    int id;
+    {
+        lock_guard<mutex> lock(jobLock);
+        job->engine = settings;
+        jobs.push_back(move(job));
+        id = int(jobs.size());
+        jobs.back()->status.id = id;
+        pending.push_back(id);
+    }
+    changed.notify_all();
+    return id;
+}
+
+bool JobQueue::getStatus(int id, JobStatus& status) {
+    lock_guard<mutex> lock(jobLock);
+    Job* job = findJob(id);
+    if (!job) {
+        return false;
+    }
+    status = snapshot(*job);
+    return true;
+}
+
+vector<JobStatus> JobQueue::getAll() {
+    lock_guard<mutex> lock(jobLock);
+    vector<JobStatus> all;
+    for (const unique_ptr<Job>& job : jobs) {
+        all.push_back(snapshot(*job));
+    }
+    return all;
+}
+
+bool JobQueue::cancel(int id) {
+    {
+        lock_guard<mutex> lock(jobLock);
+        Job* job = findJob(id);
+        if (!job || job->status.finished()) {
+            return false;
+        }
+        job->progress.cancel();
+        if (job->status.state == JOB_QUEUED) {
+            pending.erase(find(pending.begin(), pending.end(), id));
+            job->status.state = JOB_CANCELLED;
+        }
+    }
+    changed.notify_all();
+    return true;
+}
+
+void JobQueue::cancelAll() {
+    {
+        lock_guard<mutex> lock(jobLock);
+        for (const unique_ptr<Job>& job : jobs) {
+            if (!job->status.finished()) {
+                job->progress.cancel();
+                if (job->status.state == JOB_QUEUED) {
+                    job->status.state = JOB_CANCELLED;
+                }
+            }
+        }
+        pending.clear();
+    }
+    changed.notify_all();
+}
+
+bool JobQueue::getStats(int id, RunStats& stats) {
+    lock_guard<mutex> lock(jobLock);
+    Job* job = findJob(id);
+    if (!job || !job->status.finished()) {
+        return false;
+    }
+    stats = job->engine.getLastStats();
+    return true;
+}
+
+JobStatus JobQueue::wait(int id) {
+    unique_lock<mutex> lock(jobLock);
+    Job* job = findJob(id);
+    if (!job) {
+        JobStatus unknown = JobStatus();
+        unknown.state = JOB_FAILED;
+        return unknown;
+    }
+    changed.wait(lock, [job] { return job->status.finished(); });
+    return snapshot(*job);
+}
+
+void JobQueue::waitAll() {
+    unique_lock<mutex> lock(jobLock);
+    changed.wait(lock, [this] {
+        for (const unique_ptr<Job>& job : jobs) {
+            if (!job->status.finished()) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
@@ -0,0 +1,3140 @@
+// FileZipper core: entropy codecs, the block stream format, the parallel
+// engine and directory archives. No GUI or windowing dependencies, so it
+// builds as a library on its own.
+#ifndef FILEZIPPER_CORE_H
+#define FILEZIPPER_CORE_H
+
+#include <iostream>
+#include <fstream>
+#include <queue>
+#include <string>
+#include <filesystem>
+#include <sstream>
+#include <ctime>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <deque>
+
+#include "FileZipperTables.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Pointer-based Huffman tree node, used by the reference decoder check
+class Node {
+public:
+    char data;
+    uint64_t freq;
+    Node* left;
+    Node* right;
+
+    Node(char data, uint64_t freq) : data(data), freq(freq), left(NULL), right(NULL) {}
+};
+
+// Longest code the encoder may emit; keeps the decoder's slow path bounded
+const int MAX_CODE_LENGTH = 15;
+// Number of bits resolved by one lookup in the decode table
+const int DECODE_TABLE_BITS = 11;
+
+// Compressed stream layout: magic, version, extension, then block frames (see
+// BlockFrame) ending with a zero-size frame, followed by the block index (see BlockIndex)
+const char STREAM_MAGIC[4] = { 'F', 'Z', 'I', 'P' };
+const char INDEX_MAGIC[4] = { 'F', 'Z', 'I', 'X' };
+const char ARCHIVE_MAGIC[4] = { 'F', 'Z', 'A', 'R' };
+const char DIRECTORY_MAGIC[4] = { 'F', 'Z', 'C', 'D' };
+const char HISTORY_MAGIC[4] = { 'F', 'Z', 'H', 'S' };
+// 2 added a codec byte to each block body, 3 stores Huffman tables as code
+// lengths, 4 added checksums to block frames
+const unsigned char STREAM_VERSION = 4;
+const unsigned char ARCHIVE_VERSION = 1;
+const unsigned char HISTORY_VERSION = 1;
+const size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+const size_t MAX_BLOCK_SIZE = 64 << 20;
+
+// Append a fixed-width value to a byte buffer
+template <typename T>
+inline void appendValue(vector<unsigned char>& out, T value) {
+    size_t pos = out.size();
+    out.resize(pos + sizeof(T));
+    memcpy(&out[pos], &value, sizeof(T));
+}
+
+// Read a fixed-width value from a byte buffer, advancing pos; false if out of range
+template <typename T>
+inline bool readValue(const unsigned char* data, size_t size, size_t& pos, T& value) {
+    if (pos > size || size - pos < sizeof(T)) {
+        return false;
+    }
+    memcpy(&value, data + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+// Parse a size such as 65536, 512K, 4M or 2G
+inline bool parseSize(const string& text, size_t& size) {
+    char* end = NULL;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str()) {
+        return false;
+    }
+    string suffix(end);
+    if (suffix == "K" || suffix == "k") {
+        value <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        value <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    size = size_t(value);
+    return true;
+}
+
+// Bytes between folds of the 32-bit sub-tables into the 64-bit totals
+const size_t HISTOGRAM_CHUNK = size_t(1) << 30;
+// Sampled histograms count one run of this many bytes per stride
+const size_t HISTOGRAM_SAMPLE_RUN = 1024;
+const size_t HISTOGRAM_SAMPLE_STRIDE = 8;
+
+// Count bytes into four interleaved sub-tables, eight bytes per load. Runs of
+// the same byte hit different counters, so each increment does not wait on
+// the store of the previous one.
+inline void countIntoTables(uint32_t tables[4][256], const unsigned char* data, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        tables[0][word & 0xFF]++;
+        tables[1][(word >> 8) & 0xFF]++;
+        tables[2][(word >> 16) & 0xFF]++;
+        tables[3][(word >> 24) & 0xFF]++;
+        tables[0][(word >> 32) & 0xFF]++;
+        tables[1][(word >> 40) & 0xFF]++;
+        tables[2][(word >> 48) & 0xFF]++;
+        tables[3][word >> 56]++;
+    }
+    for (; i < size; i++) {
+        tables[0][data[i]]++;
+    }
+}
+
+inline void foldTables(const uint32_t tables[4][256], uint64_t counts[256]) {
+    for (int s = 0; s < 256; s++) {
+        counts[s] += uint64_t(tables[0][s]) + tables[1][s] + tables[2][s] + tables[3][s];
+    }
+}
+
+// Add the byte histogram of a buffer to counts
+inline void countBytes(const unsigned char* data, size_t size, uint64_t counts[256]) {
+    uint32_t tables[4][256];
+    while (size > 0) {
+        size_t n = min(size, HISTOGRAM_CHUNK);
+        memset(tables, 0, sizeof(tables));
+        countIntoTables(tables, data, n);
+        foldTables(tables, counts);
+        data += n;
+        size -= n;
+    }
+}
+
+// Estimate the histogram from one run in every HISTOGRAM_SAMPLE_STRIDE, scaled
+// up to the whole buffer so its bit costs compare with exact counts. Every
+// byte value gets a weight of at least 1 so unsampled bytes still have a code.
+inline void countBytesSampled(const unsigned char* data, size_t size, uint64_t counts[256]) {
+    uint32_t tables[4][256];
+    memset(tables, 0, sizeof(tables));
+    uint64_t estimate[256] = { 0 };
+    const size_t step = HISTOGRAM_SAMPLE_RUN * HISTOGRAM_SAMPLE_STRIDE;
+    size_t sampled = 0;
+    uint64_t total = 0;
+    for (size_t pos = 0; pos < size; pos += step) {
+        size_t n = min(HISTOGRAM_SAMPLE_RUN, size - pos);
+        countIntoTables(tables, data + pos, n);
+        sampled += n;
+        total += n;
+        if (sampled >= HISTOGRAM_CHUNK) {
+            foldTables(tables, estimate);
+            memset(tables, 0, sizeof(tables));
+            sampled = 0;
+        }
+    }
+    foldTables(tables, estimate);
+    for (int s = 0; s < 256; s++) {
+        if (total > 0) {
+            counts[s] += estimate[s] * size / total;
+        }
+        if (counts[s] == 0) {
+            counts[s] = 1;
+        }
+    }
+}
+
+// CRC32C (Castagnoli) of a buffer, continuing from crc (0 to start). Uses the
+// SSE4.2 or ARMv8 CRC instructions when the CPU has them, otherwise a
+// slicing-by-8 table.
+uint32_t crc32c(uint32_t crc, const unsigned char* data, size_t size);
+
+// CRC32C of A followed by B, from the CRCs of each and the size of B
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t sizeB);
+
+// Streaming xxHash64, for content hashes where CRC32C's 32 bits are too few
+class XxHash64 {
+private:
+    uint64_t acc[4];
+    unsigned char buffer[32];
+    size_t buffered;
+    uint64_t total;
+    uint64_t seed;
+
+public:
+    explicit XxHash64(uint64_t seed = 0) {
+        reset(seed);
+    }
+
+    void reset(uint64_t newSeed = 0);
+
+    void update(const unsigned char* data, size_t size);
+
+    // Hash of everything passed to update so far
+    uint64_t digest() const;
+};
+
+inline uint64_t xxHash64(const unsigned char* data, size_t size, uint64_t seed = 0) {
+    XxHash64 hash(seed);
+    hash.update(data, size);
+    return hash.digest();
+}
+
+// Stages of a compress or decompress run, timed separately. Tree covers
+// building the Huffman tree or normalizing FSE counts; codegen turns that
+// into code lengths, canonical codes or coding tables.
+enum Stage {
+    STAGE_READ,
+    STAGE_HISTOGRAM,
+    STAGE_MATCH,
+    STAGE_TREE,
+    STAGE_CODEGEN,
+    STAGE_ENCODE,
+    STAGE_DECODE,
+    STAGE_CHECKSUM,
+    STAGE_WRITE,
+    STAGE_COUNT
+};
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {
+    "read", "histogram", "match", "tree", "codegen", "encode", "decode", "checksum", "write"
+};
+
+struct StageCounter {
+    uint64_t calls;
+    uint64_t bytes;
+    double wallSeconds;
+    double cpuSeconds;
+};
+
+// Per-stage counters. Each thread fills its own, so recording takes no
+// locks; a run merges them when it ends.
+struct StageStats {
+    StageCounter stages[STAGE_COUNT];
+
+    StageStats() {
+        clear();
+    }
+
+    void clear() {
+        memset(stages, 0, sizeof(stages));
+    }
+
+    void merge(const StageStats& other) {
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            stages[i].calls += other.stages[i].calls;
+            stages[i].bytes += other.stages[i].bytes;
+            stages[i].wallSeconds += other.stages[i].wallSeconds;
+            stages[i].cpuSeconds += other.stages[i].cpuSeconds;
+        }
+    }
+};
+
+// CPU time used so far by the calling thread, in seconds
+double threadCpuSeconds();
+
+#ifdef FILEZIPPER_STATS
+const bool STATS_ENABLED = true;
+
+// Adds the wall and CPU time of its scope, and a byte count, to one stage.
+// A NULL target records nothing.
+class StageTimer {
+private:
+    StageCounter* counter;
+    chrono::steady_clock::time_point wallStart;
+    double cpuStart;
+
+public:
+    StageTimer(StageStats* stats, Stage stage, uint64_t bytes = 0)
+        : counter(stats ? &stats->stages[stage] : NULL), cpuStart(0.0) {
+        if (counter) {
+            counter->calls++;
+            counter->bytes += bytes;
+            wallStart = chrono::steady_clock::now();
+            cpuStart = threadCpuSeconds();
+        }
+    }
+
+    ~StageTimer() {
+        if (counter) {
+            counter->cpuSeconds += threadCpuSeconds() - cpuStart;
+            counter->wallSeconds += chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+        }
+    }
+
+    // For stages that only learn their size as they finish, such as reads
+    void addBytes(uint64_t bytes) {
+        if (counter) {
+            counter->bytes += bytes;
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+};
+#else
+const bool STATS_ENABLED = false;
+
+// Instrumentation compiled out: timers are empty and vanish when inlined
+class StageTimer {
+public:
+    StageTimer(StageStats*, Stage, uint64_t = 0) {}
+
+    void addBytes(uint64_t) {}
+};
+#endif
+
+// Load 8 bytes as a big-endian word (bit streams are written MSB first)
+inline uint64_t loadBigEndian64(const unsigned char* p) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return __builtin_bswap64(word);
+#else
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++) {
+        word = (word << 8) | p[i];
+    }
+    return word;
+#endif
+}
+
+// Store a word as 8 big-endian bytes
+inline void storeBigEndian64(unsigned char* p, uint64_t word) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+    memcpy(p, &word, sizeof(word));
+#else
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (unsigned char)word;
+        word >>= 8;
+    }
+#endif
+}
+
+// Code bits (right-aligned) and length for one symbol
+struct HuffmanCode {
+    uint32_t bits;
+    unsigned char length;
+};
+
+// Writes an MSB-first bit stream, packing codes into a 64-bit accumulator and
+// flushing whole words onto the end of an output buffer
+class BitWriter {
+private:
+    vector<unsigned char>& out;
+    size_t pos;             // Write position in out
+    uint64_t accumulator;   // Pending bits, right-aligned
+    int bitCount;           // Number of pending bits
+
+    void reserveWord() {
+        if (pos + 8 > out.size()) {
+            out.resize(max(out.size() * 2, pos + (64 << 10)));
+        }
+    }
+
+public:
+    explicit BitWriter(vector<unsigned char>& out)
+        : out(out), pos(out.size()), accumulator(0), bitCount(0) {}
+
+    // Append a code of up to 32 bits
+    void write(uint32_t bits, int length) {
+        if (bitCount + length < 64) {
+            accumulator = (accumulator << length) | bits;
+            bitCount += length;
+            return;
+        }
+
+        // Top up the accumulator to a full word and flush it
+        int room = 64 - bitCount;
+        accumulator = (accumulator << room) | (bits >> (length - room));
+        reserveWord();
+        storeBigEndian64(&out[pos], accumulator);
+        pos += 8;
+
+        bitCount = length - room;
+        accumulator = bits & ((uint64_t(1) << bitCount) - 1);
+    }
+
+    // Pad the last byte with zero bits and trim the buffer to the written size
+    void finish() {
+        if (bitCount > 0) {
+            reserveWord();
+            storeBigEndian64(&out[pos], accumulator << (64 - bitCount));
+            pos += (bitCount + 7) / 8;
+            accumulator = 0;
+            bitCount = 0;
+        }
+        out.resize(pos);
+    }
+};
+
+// Reads an MSB-first bit stream from memory, refilling a machine word at a time
+class BitReader {
+private:
+    const unsigned char* ptr;
+    const unsigned char* end;
+    uint64_t buffer;    // Pending bits, left-aligned
+    int bitCount;       // Number of valid bits in buffer
+
+public:
+    BitReader(const unsigned char* data, size_t size)
+        : ptr(data), end(data + size), buffer(0), bitCount(0) {}
+
+    // Top up the buffer to at least 57 bits, or with everything that is left
+    void refill() {
+        if (end - ptr >= 8) {
+            // Bits below bitCount + 8 * bytes are the start of the next byte,
+            // so or-ing them in again on the following refill is harmless
+            buffer |= loadBigEndian64(ptr) >> bitCount;
+            int bytes = (63 - bitCount) >> 3;
+            ptr += bytes;
+            bitCount += bytes << 3;
+        } else {
+            while (bitCount <= 56 && ptr < end) {
+                buffer |= uint64_t(*ptr++) << (56 - bitCount);
+                bitCount += 8;
+            }
+        }
+    }
+
+    uint32_t peek(int n) const {
+        return uint32_t(buffer >> (64 - n));
+    }
+
+    void consume(int n) {
+        buffer <<= n;
+        bitCount -= n;
+    }
+
+    // Take n bits, 0 <= n <= 32; the caller refills
+    uint32_t readBits(int n) {
+        uint32_t value = uint32_t((buffer >> (63 - n)) >> 1);
+        consume(n);
+        return value;
+    }
+
+    // True once more bits were consumed than the stream contains
+    bool overrun() const {
+        return bitCount < 0;
+    }
+};
+
+// Table-driven decoder for canonical Huffman codes. One lookup on the next
+// DECODE_TABLE_BITS bits yields up to two symbols; longer codes fall back to
+// a per-length canonical search.
+class HuffmanDecoder {
+private:
+    struct TableEntry {
+        unsigned char first;        // First decoded symbol
+        unsigned char second;       // Second decoded symbol, if any
+        unsigned char firstLength;  // Bits used by the first symbol, 0 = slow path
+        unsigned char totalLength;  // Bits used by both symbols
+    };
+
+    TableEntry table[1 << DECODE_TABLE_BITS];
+    uint32_t firstCode[MAX_CODE_LENGTH + 1];
+    uint32_t lengthCount[MAX_CODE_LENGTH + 1];
+    uint32_t firstIndex[MAX_CODE_LENGTH + 1];
+    unsigned char sortedSymbols[256];
+    uint16_t single[1 << DECODE_TABLE_BITS];    // Build scratch: symbol | length << 8
+    int maxLength;
+
+    // Helper function to decode a code longer than the table width
+    bool decodeSlow(BitReader& reader, unsigned char& symbol) const {
+        for (int len = DECODE_TABLE_BITS + 1; len <= maxLength; len++) {
+            uint32_t offset = reader.peek(len) - firstCode[len];
+            if (offset < lengthCount[len]) {
+                symbol = sortedSymbols[firstIndex[len] + offset];
+                reader.consume(len);
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    HuffmanDecoder() : maxLength(0) {}
+
+    // Build lookup tables from per-symbol code lengths (0 = unused symbol)
+    bool build(const unsigned char codeLengths[256]) {
+        memset(lengthCount, 0, sizeof(lengthCount));
+        maxLength = 0;
+        for (int s = 0; s < 256; s++) {
+            if (codeLengths[s] > MAX_CODE_LENGTH) {
+                return false;
+            }
+            lengthCount[codeLengths[s]]++;
+            maxLength = max(maxLength, int(codeLengths[s]));
+        }
+        lengthCount[0] = 0;
+
+        uint32_t code = 0;
+        uint32_t index = 0;
+        firstCode[0] = 0;
+        firstIndex[0] = 0;
+        for (int len = 1; len <= MAX_CODE_LENGTH; len++) {
+            code = (code + lengthCount[len - 1]) << 1;
+            firstCode[len] = code;
+            firstIndex[len] = index;
+            index += lengthCount[len];
+            if (code + lengthCount[len] > (1u << len)) {
+                return false;   // Over-subscribed code
+            }
+        }
+
+        uint32_t next = 0;
+        for (int len = 1; len <= MAX_CODE_LENGTH; len++) {
+            for (int s = 0; s < 256; s++) {
+                if (codeLengths[s] == len) {
+                    sortedSymbols[next++] = (unsigned char)s;
+                }
+            }
+        }
+
+        // Single-symbol table: symbol | length << 8, 0 where no short code matches
+        const uint32_t tableSize = 1u << DECODE_TABLE_BITS;
+        memset(single, 0, sizeof(single));
+        for (int len = 1; len <= min(maxLength, DECODE_TABLE_BITS); len++) {
+            for (uint32_t i = 0; i < lengthCount[len]; i++) {
+                unsigned char symbol = sortedSymbols[firstIndex[len] + i];
+                uint32_t start = (firstCode[len] + i) << (DECODE_TABLE_BITS - len);
+                uint32_t span = 1u << (DECODE_TABLE_BITS - len);
+                for (uint32_t j = 0; j < span; j++) {
+                    single[start + j] = uint16_t(symbol | (len << 8));
+                }
+            }
+        }
+
+        // Pair up a second symbol wherever it fits in the remaining bits
+        for (uint32_t i = 0; i < tableSize; i++) {
+            TableEntry& entry = table[i];
+            uint16_t a = single[i];
+            int lenA = a >> 8;
+            entry.first = (unsigned char)(a & 0xFF);
+            entry.second = 0;
+            entry.firstLength = (unsigned char)lenA;
+            entry.totalLength = (unsigned char)lenA;
+            if (lenA == 0) {
+                continue;
+            }
+            uint16_t b = single[(i << lenA) & (tableSize - 1)];
+            int lenB = b >> 8;
+            if (lenB != 0 && lenB <= DECODE_TABLE_BITS - lenA) {
+                entry.second = (unsigned char)(b & 0xFF);
+                entry.totalLength = (unsigned char)(lenA + lenB);
+            }
+        }
+        return true;
+    }
+
+    // Decode exactly count symbols; false on corrupt or truncated input
+    bool decode(BitReader& reader, unsigned char* out, size_t count) const {
+        size_t produced = 0;
+        while (produced < count) {
+            reader.refill();
+            const TableEntry& entry = table[reader.peek(DECODE_TABLE_BITS)];
+            if (entry.firstLength == 0) {
+                if (!decodeSlow(reader, out[produced++])) {
+                    return false;
+                }
+            } else if (entry.totalLength != entry.firstLength && count - produced >= 2) {
+                out[produced++] = entry.first;
+                out[produced++] = entry.second;
+                reader.consume(entry.totalLength);
+            } else {
+                out[produced++] = entry.first;
+                reader.consume(entry.firstLength);
+            }
+            if (reader.overrun()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Block frame header: [uint32 raw size][uint32 body size], then from stream
+// version 4 [uint32 raw CRC][uint32 frame CRC], then the body ([codec][data]).
+// The raw CRC is the CRC32C of the uncompressed block; in the zero-size frame
+// that ends the stream it is the CRC32C of all the uncompressed data. The
+// frame CRC covers the first three fields and the body, so a frame can be
+// checked without decoding it.
+struct BlockFrame {
+    uint32_t rawSize;
+    uint32_t bodySize;
+    uint32_t rawCrc;
+    uint32_t frameCrc;
+};
+
+// Size of a block frame header in a stream of the given version
+inline size_t frameHeaderSize(unsigned char version) {
+    return version >= 4 ? 4 * sizeof(uint32_t) : 2 * sizeof(uint32_t);
+}
+
+// Location of one block in a compressed stream
+struct BlockIndexEntry {
+    uint64_t compressedOffset;  // Offset of the block frame from the start of the stream
+    uint64_t rawOffset;         // Offset of the block's first byte in the original data
+    uint32_t rawSize;
+};
+
+// Block index written after the end-of-stream marker so readers can seek
+// straight to the blocks covering a byte range:
+// [entries: uint64 compressed offset, uint64 raw offset, uint32 raw size]
+// [uint64 index offset][uint64 block count]["FZIX"]
+class BlockIndex {
+private:
+    vector<BlockIndexEntry> entries;
+    uint64_t compressedPos;
+    uint64_t rawPos;
+
+public:
+    static const size_t ENTRY_SIZE = 20;
+    static const size_t TRAILER_SIZE = 20;
+
+    BlockIndex() : compressedPos(0), rawPos(0) {}
+
+    // Start counting after a stream header of the given size
+    void start(uint64_t headerSize) {
+        entries.clear();
+        compressedPos = headerSize;
+        rawPos = 0;
+    }
+
+    // Record a block frame as it is written
+    void add(size_t rawSize, size_t bodySize) {
+        entries.push_back(BlockIndexEntry{ compressedPos, rawPos, uint32_t(rawSize) });
+        compressedPos += frameHeaderSize(STREAM_VERSION) + bodySize;
+        rawPos += rawSize;
+    }
+
+    // Bytes the index and trailer take when written
+    size_t storedSize() const {
+        return entries.size() * ENTRY_SIZE + TRAILER_SIZE;
+    }
+
+    // Write the index and trailer to storedSize() bytes at out
+    void store(unsigned char* out) const {
+        uint64_t indexOffset = compressedPos + frameHeaderSize(STREAM_VERSION);
+        for (const BlockIndexEntry& entry : entries) {
+            memcpy(out, &entry.compressedOffset, sizeof(uint64_t));
+            memcpy(out + 8, &entry.rawOffset, sizeof(uint64_t));
+            memcpy(out + 16, &entry.rawSize, sizeof(uint32_t));
+            out += ENTRY_SIZE;
+        }
+        uint64_t blockCount = entries.size();
+        memcpy(out, &indexOffset, sizeof(indexOffset));
+        memcpy(out + 8, &blockCount, sizeof(blockCount));
+        memcpy(out + 16, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    }
+
+    // Write the index and trailer; call after the end-of-stream marker
+    bool write(ostream& out) const {
+        vector<unsigned char> data(storedSize());
+        store(data.data());
+        out.write(reinterpret_cast<const char*>(data.data()), data.size());
+        return bool(out);
+    }
+
+    // Load the index from the end of a seekable stream
+    static bool read(istream& in, vector<BlockIndexEntry>& result) {
+        in.seekg(0, ios::end);
+        streamoff fileSize = in.tellg();
+        if (fileSize < streamoff(TRAILER_SIZE)) {
+            return false;
+        }
+
+        unsigned char trailer[TRAILER_SIZE];
+        in.seekg(fileSize - streamoff(TRAILER_SIZE));
+        in.read(reinterpret_cast<char*>(trailer), sizeof(trailer));
+        size_t pos = 0;
+        uint64_t indexOffset, blockCount;
+        readValue(trailer, sizeof(trailer), pos, indexOffset);
+        readValue(trailer, sizeof(trailer), pos, blockCount);
+        if (!in || memcmp(trailer + pos, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 ||
+            indexOffset > uint64_t(fileSize) ||
+            blockCount != (uint64_t(fileSize) - TRAILER_SIZE - indexOffset) / ENTRY_SIZE) {
+            return false;
+        }
+
+        vector<unsigned char> data(size_t(blockCount) * ENTRY_SIZE);
+        in.seekg(streamoff(indexOffset));
+        in.read(reinterpret_cast<char*>(data.data()), data.size());
+        if (!in) {
+            return false;
+        }
+
+        result.resize(size_t(blockCount));
+        pos = 0;
+        uint64_t expectedRaw = 0;
+        for (BlockIndexEntry& entry : result) {
+            readValue(data.data(), data.size(), pos, entry.compressedOffset);
+            readValue(data.data(), data.size(), pos, entry.rawOffset);
+            readValue(data.data(), data.size(), pos, entry.rawSize);
+            if (entry.rawOffset != expectedRaw || entry.compressedOffset >= indexOffset) {
+                return false;
+            }
+            expectedRaw += entry.rawSize;
+        }
+        return true;
+    }
+};
+
+// Block codec byte, from stream version 2: bit 0 is set when the LZ stage
+// ran, the remaining bits select the entropy coder
+const unsigned char CODEC_LZ = 1;
+const int ENTROPY_HUFFMAN = 0;
+const int ENTROPY_FSE = 1;
+const int ENTROPY_STATIC = 2;   // Pretrained Huffman table, from stream version 3
+const int ENTROPY_AUTO = -1;    // Whichever is estimated smaller, per block
+const unsigned char CODEC_STORED = 0xFF;    // Raw bytes, for blocks coding cannot shrink
+
+// Entropy coder for a stream of byte symbols. A coder is prepared from a
+// histogram, writes the table its decoder needs, then codes the payload.
+class EntropyCodec {
+protected:
+    StageStats* stats;      // Where prepare records tree and codegen time; NULL for none
+
+public:
+    EntropyCodec() : stats(NULL) {}
+
+    virtual ~EntropyCodec() {}
+
+    void setStats(StageStats* target) {
+        stats = target;
+    }
+
+    // Build the code for a histogram; returns the estimated coded size in
+    // bits, table included. An all-zero histogram describes an empty stream.
+    virtual uint64_t prepare(const uint64_t frequency[256]) = 0;
+
+    // Append the table for the prepared code
+    virtual void writeTable(vector<unsigned char>& out) const = 0;
+
+    // Append the payload for size symbols, all of which must have been counted
+    virtual bool encode(const unsigned char* data, size_t size, vector<unsigned char>& out) = 0;
+
+    // Read a table written by writeTable; symbolCount is 0 for an empty stream
+    virtual bool readTable(const unsigned char* data, size_t dataSize, size_t& pos, int& symbolCount) = 0;
+
+    // Decode count symbols from a payload using the table just read
+    virtual bool decode(const unsigned char* payload, size_t payloadSize, unsigned char* out, size_t count) = 0;
+};
+
+// Canonical Huffman coder. The table is the code lengths, packed as
+// [uint8 byte count][4-bit values, high nibble first]: a value of 1-15 is the
+// length of the next symbol's code, 0 followed by n skips n + 1 unused
+// symbols, and symbols after the last code are unused. Stream versions 1 and
+// 2 stored the symbol weights instead, from which the decoder rebuilt the tree.
+class HuffmanCodec : public EntropyCodec {
+private:
+    // Tree in fixed arrays, reused by every build: nodes 0-255 are the leaves
+    // by byte value, internal nodes follow in the order they are merged
+    static const int NODE_COUNT = 511;
+    uint64_t nodeWeight[NODE_COUNT];
+    uint16_t nodeParent[NODE_COUNT];
+    uint16_t nodeDepth[NODE_COUNT];
+    uint16_t heap[256];
+    uint16_t leafOrder[256];    // Used symbols, lightest first
+    int rootNode;           // -1 for an empty tree
+
+    array<HuffmanCode, 256> huffmanCode;
+    unsigned char codeLengths[256];
+    uint64_t weights[256];
+    vector<unsigned char> lengthTable;  // Table for the prepared code
+    bool weightTables;                  // Read tables in the version 1-2 format
+    HuffmanDecoder decoder;
+
+    // Helper function to set leaf depths as code lengths, top down without recursion
+    void collectCodeLengths() {
+        // Every internal node is merged after its children, so walking back
+        // from the root visits each parent before its children
+        nodeDepth[rootNode] = 0;
+        for (int n = rootNode - 1; n >= 256; n--) {
+            nodeDepth[n] = nodeDepth[nodeParent[n]] + 1;
+        }
+        for (int c = 0; c < 256; c++) {
+            if (nodeWeight[c] == 0) continue;
+
+            // A lone symbol still needs one bit per occurrence
+            int depth = (c == rootNode) ? 0 : nodeDepth[nodeParent[c]] + 1;
+            codeLengths[c] = (unsigned char)min(max(depth, 1), 255);
+        }
+    }
+
+    // Helper function to cap code lengths at MAX_CODE_LENGTH while keeping a valid prefix code
+    void limitCodeLengths() {
+        // A Huffman tree is complete, so unless a code is too long there is
+        // nothing to cap and no slack to hand back
+        unsigned char longest = 0;
+        for (int s = 0; s < 256; s++) {
+            longest = max(longest, codeLengths[s]);
+        }
+        if (longest <= MAX_CODE_LENGTH) {
+            return;
+        }
+
+        const uint32_t capacity = 1u << MAX_CODE_LENGTH;
+        uint32_t kraft = 0;
+        for (int s = 0; s < 256; s++) {
+            if (codeLengths[s] > MAX_CODE_LENGTH) {
+                codeLengths[s] = MAX_CODE_LENGTH;
+            }
+            if (codeLengths[s]) {
+                kraft += capacity >> codeLengths[s];
+            }
+        }
+
+        // Lengthen the longest codes that can still grow until the code fits
+        while (kraft > capacity) {
+            int pick = -1;
+            for (int s = 0; s < 256; s++) {
+                if (codeLengths[s] && codeLengths[s] < MAX_CODE_LENGTH &&
+                    (pick < 0 || codeLengths[s] > codeLengths[pick])) {
+                    pick = s;
+                }
+            }
+            codeLengths[pick]++;
+            kraft -= capacity >> codeLengths[pick];
+        }
+
+        // Hand any slack back to the longest codes
+        for (int len = MAX_CODE_LENGTH; len > 1; len--) {
+            for (int s = 0; s < 256; s++) {
+                if (codeLengths[s] == len && kraft + (capacity >> len) <= capacity) {
+                    kraft += capacity >> len;
+                    codeLengths[s]--;
+                }
+            }
+        }
+    }
+
+
+#ifdef FILEZIPPER_CHECK_DECODER
+    // Orders the reference tree's priority_queue as the original decoder did
+    struct HeavierNode {
+        bool operator()(const Node* l, const Node* r) const {
+            return l->freq > r->freq;
+        }
+    };
+
+    // Helper function to build a pointer tree from weights the way the
+    // original decoder did, pushing leaves in byte order
+    static Node* buildReferenceTree(const uint64_t weights[256]) {
+        priority_queue<Node*, vector<Node*>, HeavierNode> queue;
+        for (int s = 0; s < 256; s++) {
+            if (weights[s] > 0) {
+                queue.push(new Node((char)s, weights[s]));
+            }
+        }
+        while (queue.size() > 1) {
+            Node* left = queue.top(); queue.pop();
+            Node* right = queue.top(); queue.pop();
+            Node* internal = new Node('\0', left->freq + right->freq);
+            internal->left = left;
+            internal->right = right;
+            queue.push(internal);
+        }
+        return queue.empty() ? NULL : queue.top();
+    }
+
+    static void collectReferenceDepths(const Node* node, int depth, int lengths[256]) {
+        if (!node->left && !node->right) {
+            lengths[(unsigned char)node->data] = max(depth, 1);
+            return;
+        }
+        collectReferenceDepths(node->left, depth + 1, lengths);
+        collectReferenceDepths(node->right, depth + 1, lengths);
+    }
+
+    static void cleanup(Node* node) {
+        if (node) {
+            cleanup(node->left);
+            cleanup(node->right);
+            delete node;
+        }
+    }
+#endif
+
+public:
+#ifdef FILEZIPPER_CHECK_DECODER
+    // Reference decoder, sharing none of the code under test: a pointer tree
+    // walked one bit at a time, as the original decoder did. With weights
+    // (stream versions 1-2 and the pre-block format) the lengths come from
+    // the original priority_queue tree, unless a code was too long and had
+    // to be capped; otherwise they are the lengths read from the stream.
+    // Canonical codes are handed out in (length, symbol) order.
+    bool checkAgainstTree(const unsigned char* payload, size_t payloadSize, size_t& bitPos,
+                          const unsigned char* decoded, size_t count, const uint64_t* weights) const {
+        int lengths[256];
+        for (int s = 0; s < 256; s++) {
+            lengths[s] = codeLengths[s];
+        }
+        if (weights) {
+            Node* weightTree = buildReferenceTree(weights);
+            int depths[256] = { 0 };
+            if (weightTree) {
+                collectReferenceDepths(weightTree, 0, depths);
+            }
+            cleanup(weightTree);
+            if (*max_element(depths, depths + 256) <= MAX_CODE_LENGTH) {
+                copy(depths, depths + 256, lengths);
+            }
+        }
+
+        vector<pair<int, int>> order;
+        for (int s = 0; s < 256; s++) {
+            if (lengths[s] > 0) {
+                order.push_back(make_pair(lengths[s], s));
+            }
+        }
+        sort(order.begin(), order.end());
+        Node* tree = new Node('\0', 0);
+        uint32_t code = 0;
+        int codeLength = order.empty() ? 0 : order[0].first;
+        for (const pair<int, int>& entry : order) {
+            code <<= entry.first - codeLength;
+            codeLength = entry.first;
+            Node* node = tree;
+            for (int i = codeLength - 1; i >= 0; i--) {
+                Node*& next = ((code >> i) & 1) ? node->right : node->left;
+                if (!next) next = new Node('\0', 0);
+                node = next;
+            }
+            node->data = (char)entry.second;
+            code++;
+        }
+
+        bool match = true;
+        for (size_t i = 0; i < count && match; i++) {
+            Node* current = tree;
+            while (current && (current->left || current->right)) {
+                if (bitPos >= payloadSize * 8) {
+                    current = NULL;
+                    break;
+                }
+                int bit = (payload[bitPos / 8] >> (7 - bitPos % 8)) & 1;
+                bitPos++;
+                current = bit ? current->right : current->left;
+            }
+            match = current && current != tree && (unsigned char)current->data == decoded[i];
+        }
+        cleanup(tree);
+        if (!match) {
+            cerr << "Decoder check failed: table decoder disagrees with tree decoder\n";
+        }
+        return match;
+    }
+#endif
+
+    HuffmanCodec() : rootNode(-1), weightTables(false) {
+        memset(nodeWeight, 0, sizeof(nodeWeight));
+        memset(codeLengths, 0, sizeof(codeLengths));
+        memset(weights, 0, sizeof(weights));
+        huffmanCode.fill(HuffmanCode{0, 0});
+    }
+
+    // Assign canonical codes from code lengths (0 = no code): count the codes
+    // of each length, derive the first code of each length, then hand codes
+    // out in symbol order
+    static void assignCanonicalCodes(const unsigned char lengths[256], array<HuffmanCode, 256>& codes) {
+        codes.fill(HuffmanCode{0, 0});
+        uint32_t lengthCount[MAX_CODE_LENGTH + 1] = { 0 };
+        for (int s = 0; s < 256; s++) {
+            if (lengths[s] <= MAX_CODE_LENGTH) {
+                lengthCount[lengths[s]]++;
+            }
+        }
+        uint32_t nextCode[MAX_CODE_LENGTH + 1];
+        uint32_t code = 0;
+        for (int len = 1; len <= MAX_CODE_LENGTH; len++) {
+            nextCode[len] = code;
+            code = (code + lengthCount[len]) << 1;
+        }
+        for (int s = 0; s < 256; s++) {
+            int len = lengths[s];
+            if (len == 0 || len > MAX_CODE_LENGTH) continue;
+
+            codes[s].bits = nextCode[len]++;
+            codes[s].length = (unsigned char)len;
+        }
+    }
+
+    // Append code lengths in the packed table format
+    static void writeLengthTable(const unsigned char lengths[256], vector<unsigned char>& out) {
+        static_assert(MAX_CODE_LENGTH <= 15, "code lengths must fit in 4 bits");
+        unsigned char nibbles[512];
+        int last = 255;
+        while (last >= 0 && lengths[last] == 0) {
+            last--;
+        }
+
+        int count = 0;
+        for (int s = 0; s <= last;) {
+            if (lengths[s] != 0) {
+                nibbles[count++] = lengths[s++];
+                continue;
+            }
+            int run = 0;
+            while (s <= last && lengths[s] == 0 && run < 16) {
+                run++;
+                s++;
+            }
+            nibbles[count++] = 0;
+            nibbles[count++] = (unsigned char)(run - 1);
+        }
+
+        // An odd count is padded with a 0, which cannot start a run at the end
+        int bytes = (count + 1) / 2;
+        appendValue<unsigned char>(out, (unsigned char)bytes);
+        for (int i = 0; i < bytes; i++) {
+            unsigned char low = (2 * i + 1 < count) ? nibbles[2 * i + 1] : 0;
+            out.push_back((unsigned char)(nibbles[2 * i] << 4 | low));
+        }
+    }
+
+    static bool readLengthTable(const unsigned char* data, size_t dataSize, size_t& pos,
+                                unsigned char lengths[256], int& symbolCount) {
+        unsigned char bytes;
+        if (!readValue(data, dataSize, pos, bytes) || dataSize - pos < bytes) {
+            return false;
+        }
+        memset(lengths, 0, 256);
+        symbolCount = 0;
+        const unsigned char* packed = data + pos;
+        size_t nibbleCount = size_t(bytes) * 2;
+        int symbol = 0;
+        for (size_t i = 0; i < nibbleCount; i++) {
+            unsigned char value = (i & 1) ? (packed[i / 2] & 0x0F) : (packed[i / 2] >> 4);
+            if (value == 0) {
+                if (i + 1 == nibbleCount) {
+                    break;
+                }
+                i++;
+                symbol += ((i & 1) ? (packed[i / 2] & 0x0F) : (packed[i / 2] >> 4)) + 1;
+                continue;
+            }
+            if (symbol >= 256) {
+                return false;
+            }
+            lengths[symbol++] = value;
+            symbolCount++;
+        }
+        pos += bytes;
+        return true;
+    }
+
+    // Read weight tables as stream versions 1 and 2 wrote them
+    void setWeightTables(bool enabled) {
+        weightTables = enabled;
+    }
+
+    // Build Huffman tree from byte frequencies; zero-frequency bytes get no code.
+    // Leaves are sorted by weight once, then merged with the two-queue method:
+    // merged nodes come out in order of weight, so the two lightest nodes are
+    // always at the front of the leaf queue or the merged queue.
+    void buildTree(const uint64_t frequency[256]) {
+        int leafCount = 0;
+        for (int c = 0; c < 256; c++) {
+            nodeWeight[c] = frequency[c];
+            if (frequency[c] > 0) {
+                leafOrder[leafCount++] = uint16_t(c);
+            }
+        }
+        sort(leafOrder, leafOrder + leafCount, [this](uint16_t a, uint16_t b) {
+            return nodeWeight[a] < nodeWeight[b] || (nodeWeight[a] == nodeWeight[b] && a < b);
+        });
+        if (leafCount < 2) {
+            rootNode = leafCount > 0 ? leafOrder[0] : -1;
+            return;
+        }
+
+        int leaf = 0;
+        int merged = 256;       // Front of the merged queue, which ends at nextNode
+        int nextNode = 256;
+        auto takeLightest = [&]() -> uint16_t {
+            if (leaf < leafCount && (merged == nextNode || nodeWeight[leafOrder[leaf]] <= nodeWeight[merged])) {
+                return leafOrder[leaf++];
+            }
+            return uint16_t(merged++);
+        };
+        while (nextNode < 256 + leafCount - 1) {
+            uint16_t left = takeLightest();
+            uint16_t right = takeLightest();
+            nodeWeight[nextNode] = nodeWeight[left] + nodeWeight[right];
+            nodeParent[left] = uint16_t(nextNode);
+            nodeParent[right] = uint16_t(nextNode);
+            nextNode++;
+        }
+        rootNode = nextNode - 1;
+    }
+
+    // Build the tree as versions before packed code lengths did, for reading
+    // their weight tables. The heap steps are exactly those of
+    // priority_queue<Node*> ordered by weight, so the decoder derives the
+    // same code lengths the encoder used; ties can break differently from
+    // buildTree, so the two are not interchangeable.
+    void buildLegacyTree(const uint64_t frequency[256]) {
+        auto heavier = [this](uint16_t a, uint16_t b) { return nodeWeight[a] > nodeWeight[b]; };
+        int heapSize = 0;
+
+        // Push in byte order so compressor and decompressor build the same tree
+        for (int c = 0; c < 256; c++) {
+            nodeWeight[c] = frequency[c];
+            if (frequency[c] > 0) {
+                heap[heapSize++] = uint16_t(c);
+                push_heap(heap, heap + heapSize, heavier);
+            }
+        }
+
+        int nextNode = 256;
+        while (heapSize > 1) {
+            uint16_t left = heap[0];
+            pop_heap(heap, heap + heapSize, heavier);
+            heapSize--;
+            uint16_t right = heap[0];
+            pop_heap(heap, heap + heapSize, heavier);
+            heapSize--;
+
+            nodeWeight[nextNode] = nodeWeight[left] + nodeWeight[right];
+            nodeParent[left] = uint16_t(nextNode);
+            nodeParent[right] = uint16_t(nextNode);
+            heap[heapSize++] = uint16_t(nextNode++);
+            push_heap(heap, heap + heapSize, heavier);
+        }
+
+        rootNode = heapSize > 0 ? heap[0] : -1;
+    }
+
+    // Generate canonical Huffman codes from the tree's code lengths
+    void generateHuffmanCodes() {
+        memset(codeLengths, 0, sizeof(codeLengths));
+        huffmanCode.fill(HuffmanCode{0, 0});
+        if (rootNode >= 0) {
+            collectCodeLengths();
+            limitCodeLengths();
+            assignCanonicalCodes(codeLengths, huffmanCode);
+        } else {
+            cerr << "Error: Huffman tree is empty. Cannot generate codes.\n";
+        }
+    }
+
+    // Encode a buffer with the current code table
+    bool encodeBuffer(const unsigned char* data, size_t size, BitWriter& writer) const {
+        for (size_t i = 0; i < size; i++) {
+            const HuffmanCode& code = huffmanCode[data[i]];
+            if (code.length == 0) {
+                return false;
+            }
+            writer.write(code.bits, code.length);
+        }
+        return true;
+    }
+
+    // Read a version 1-2 table, [uint16 symbol count][(uint8 symbol, uint32 weight)...].
+    // Weights need not sum to the symbol count, since sampled histograms were
+    // stored as they are.
+    static bool readFrequencyTable(const unsigned char* data, size_t dataSize, size_t& pos,
+                                   uint64_t frequency[256], int& symbolCount) {
+        uint16_t count;
+        if (!readValue(data, dataSize, pos, count) || count > 256) {
+            return false;
+        }
+        memset(frequency, 0, 256 * sizeof(uint64_t));
+        for (int i = 0; i < count; i++) {
+            unsigned char ch;
+            uint32_t freq;
+            if (!readValue(data, dataSize, pos, ch) || !readValue(data, dataSize, pos, freq) ||
+                freq == 0 || freq > MAX_BLOCK_SIZE) {
+                return false;
+            }
+            frequency[ch] = freq;
+        }
+        symbolCount = count;
+        return true;
+    }
+
+    uint64_t prepare(const uint64_t frequency[256]) override {
+        memcpy(weights, frequency, sizeof(weights));
+        memset(codeLengths, 0, sizeof(codeLengths));
+        bool empty = true;
+        for (int c = 0; c < 256 && empty; c++) {
+            empty = (frequency[c] == 0);
+        }
+        if (!empty) {
+            StageTimer timer(stats, STAGE_TREE);
+            buildTree(frequency);
+        }
+
+        StageTimer timer(stats, STAGE_CODEGEN);
+        if (!empty) {
+            generateHuffmanCodes();
+        }
+        lengthTable.clear();
+        writeLengthTable(codeLengths, lengthTable);
+        uint64_t bits = 8 * lengthTable.size();
+        for (int c = 0; c < 256; c++) {
+            bits += frequency[c] * codeLengths[c];
+        }
+        return bits;
+    }
+
+    void writeTable(vector<unsigned char>& out) const override {
+        out.insert(out.end(), lengthTable.begin(), lengthTable.end());
+    }
+
+    bool encode(const unsigned char* data, size_t size, vector<unsigned char>& out) override {
+        BitWriter writer(out);
+        bool encoded = encodeBuffer(data, size, writer);
+        writer.finish();
+        return encoded;
+    }
+
+    bool readTable(const unsigned char* data, size_t dataSize, size_t& pos, int& symbolCount) override {
+        if (!weightTables) {
+            if (!readLengthTable(data, dataSize, pos, codeLengths, symbolCount)) {
+                return false;
+            }
+            if (symbolCount == 0) {
+                return true;
+            }
+            assignCanonicalCodes(codeLengths, huffmanCode);
+            return decoder.build(codeLengths);
+        }
+
+        if (!readFrequencyTable(data, dataSize, pos, weights, symbolCount)) {
+            return false;
+        }
+        if (symbolCount == 0) {
+            return true;
+        }
+        buildLegacyTree(weights);
+        generateHuffmanCodes();
+        return decoder.build(codeLengths);
+    }
+
+    bool decode(const unsigned char* payload, size_t payloadSize, unsigned char* out, size_t count) override {
+        BitReader reader(payload, payloadSize);
+        if (!decoder.decode(reader, out, count)) {
+            return false;
+        }
+#ifdef FILEZIPPER_CHECK_DECODER
+        size_t treeBitPos = 0;
+        if (!checkAgainstTree(payload, payloadSize, treeBitPos, out, count, weightTables ? weights : NULL)) {
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    // Get the Huffman codes, indexed by byte value
+    const array<HuffmanCode, 256>& getHuffmanCodes() const {
+        return huffmanCode;
+    }
+
+    const unsigned char* getCodeLengths() const {
+        return codeLengths;
+    }
+};
+
+// Huffman coder over a pretrained table (see FileZipperTables.h). The table
+// is one byte, [uint8 table id << 3 | slot], or 0xFF for an empty stream, so
+// small blocks skip both the histogram-derived table and its cost. Every
+// symbol a slot can see has a code, so any input can be coded.
+class StaticCodec : public EntropyCodec {
+private:
+    static const unsigned char EMPTY_TABLE = 0xFF;
+
+    // Codes for each slot of the table last selected, built on first use
+    struct Slot {
+        int table;          // -1 until built
+        unsigned char lengths[256];
+        array<HuffmanCode, 256> codes;
+        HuffmanDecoder decoder;
+    };
+    Slot slots[STATIC_SLOT_COUNT];
+    int activeTable;
+    int activeSlot;
+    bool empty;
+
+public:
+    StaticCodec() : activeTable(-1), activeSlot(0), empty(false) {
+        for (Slot& slot : slots) {
+            slot.table = -1;
+        }
+    }
+
+    // Look up a table by name; -1 if there is none
+    static int findTable(const string& name) {
+        for (int i = 0; i < STATIC_TABLE_COUNT; i++) {
+            if (name == STATIC_TABLES[i].name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Code with one slot of a table until the next select
+    bool select(int table, int slot) {
+        if (table < 0 || table >= STATIC_TABLE_COUNT || slot < 0 || slot >= STATIC_SLOT_COUNT) {
+            return false;
+        }
+        activeTable = table;
+        activeSlot = slot;
+        empty = false;
+        Slot& built = slots[slot];
+        if (built.table == table) {
+            return true;
+        }
+
+        memset(built.lengths, 0, sizeof(built.lengths));
+        const char* digits = STATIC_TABLES[table].lengths[slot];
+        for (int s = 0; s < 256 && digits[s]; s++) {
+            char digit = digits[s];
+            built.lengths[s] = (unsigned char)(digit <= '9' ? digit - '0' : digit - 'A' + 10);
+        }
+        HuffmanCodec::assignCanonicalCodes(built.lengths, built.codes);
+        if (!built.decoder.build(built.lengths)) {
+            return false;
+        }
+        built.table = table;
+        return true;
+    }
+
+    uint64_t prepare(const uint64_t frequency[256]) override {
+        const unsigned char* lengths = slots[activeSlot].lengths;
+        uint64_t bits = 8;
+        empty = true;
+        for (int c = 0; c < 256; c++) {
+            if (frequency[c] == 0) continue;
+
+            empty = false;
+            if (lengths[c] == 0) {
+                return UINT64_MAX;
+            }
+            bits += frequency[c] * lengths[c];
+        }
+        return bits;
+    }
+
+    void writeTable(vector<unsigned char>& out) const override {
+        appendValue<unsigned char>(out, empty ? EMPTY_TABLE : (unsigned char)(activeTable << 3 | activeSlot));
+    }
+
+    bool encode(const unsigned char* data, size_t size, vector<unsigned char>& out) override {
+        const array<HuffmanCode, 256>& codes = slots[activeSlot].codes;
+        BitWriter writer(out);
+        bool encoded = true;
+        for (size_t i = 0; i < size; i++) {
+            const HuffmanCode& code = codes[data[i]];
+            if (code.length == 0) {
+                encoded = false;
+                break;
+            }
+            writer.write(code.bits, code.length);
+        }
+        writer.finish();
+        return encoded;
+    }
+
+    bool readTable(const unsigned char* data, size_t dataSize, size_t& pos, int& symbolCount) override {
+        unsigned char id;
+        if (!readValue(data, dataSize, pos, id)) {
+            return false;
+        }
+        if (id == EMPTY_TABLE) {
+            symbolCount = 0;
+            return true;
+        }
+        if (!select(id >> 3, id & 7)) {
+            return false;
+        }
+        symbolCount = 0;
+        for (int c = 0; c < 256; c++) {
+            if (slots[activeSlot].lengths[c]) symbolCount++;
+        }
+        return true;
+    }
+
+    bool decode(const unsigned char* payload, size_t payloadSize, unsigned char* out, size_t count) override {
+        BitReader reader(payload, payloadSize);
+        return slots[activeSlot].decoder.decode(reader, out, count);
+    }
+};
+
+// Table-based asymmetric numeral system (tANS) coder, as in FSE. Symbol
+// counts are normalized to a power-of-two table of states, so a frequent
+// symbol can cost a fraction of a bit where Huffman spends a whole one.
+// Symbols are encoded last to first and their bits replayed in order, so
+// the decoder reads forward with one table lookup per symbol.
+class FseCodec : public EntropyCodec {
+private:
+    static const int MIN_TABLE_LOG = 5;
+    static const int MAX_TABLE_LOG = 12;
+
+    struct DecodeEntry {
+        uint16_t baseState;     // Next state before adding the bits read
+        unsigned char symbol;
+        unsigned char bitCount;
+    };
+
+    struct SymbolTransform {
+        uint32_t threshold;     // States below this emit one bit fewer
+        int maxBits;
+        int stateOffset;        // Maps (state >> bits) into encodeStates
+    };
+
+    int tableLog;
+    int symbolCount;
+    uint16_t normalized[256];
+    SymbolTransform transform[256];
+    uint16_t encodeStates[1 << MAX_TABLE_LOG];
+    DecodeEntry decodeTable[1 << MAX_TABLE_LOG];
+    vector<uint16_t> chunks;    // Per symbol: bits << 12 | value, replayed forward
+
+    static int highBit(uint32_t value) {
+        int bit = 0;
+        while (value >>= 1) {
+            bit++;
+        }
+        return bit;
+    }
+
+    // Helper function to scale counts to sum to the table size, keeping every symbol
+    void normalize(const uint64_t frequency[256]) {
+        uint64_t total = 0;
+        symbolCount = 0;
+        for (int s = 0; s < 256; s++) {
+            total += frequency[s];
+            if (frequency[s] > 0) symbolCount++;
+        }
+        memset(normalized, 0, sizeof(normalized));
+        if (symbolCount == 0) {
+            return;
+        }
+
+        // Room for every symbol, but no more states than the data can use
+        tableLog = MIN_TABLE_LOG;
+        while (tableLog < MAX_TABLE_LOG &&
+               ((1u << tableLog) < uint32_t(symbolCount) * 2 || (uint64_t(1) << tableLog) < total)) {
+            tableLog++;
+        }
+
+        uint32_t size = 1u << tableLog;
+        uint32_t assigned = 0;
+        int largest = -1;
+        for (int s = 0; s < 256; s++) {
+            if (frequency[s] == 0) continue;
+            uint64_t scaled = (frequency[s] * size + total / 2) / total;
+            normalized[s] = uint16_t(max<uint64_t>(scaled, 1));
+            assigned += normalized[s];
+            if (largest < 0 || frequency[s] > frequency[largest]) {
+                largest = s;
+            }
+        }
+
+        // Rounding up rare symbols can overshoot; take the excess from the largest counts
+        while (assigned > size) {
+            int pick = largest;
+            for (int s = 0; s < 256; s++) {
+                if (normalized[s] > normalized[pick]) pick = s;
+            }
+            normalized[pick]--;
+            assigned--;
+        }
+        normalized[largest] += uint16_t(size - assigned);
+    }
+
+    // Helper function to scatter each symbol's states across the table
+    void spreadSymbols(unsigned char* spread) const {
+        uint32_t size = 1u << tableLog;
+        uint32_t step = (size >> 1) + (size >> 3) + 3;
+        uint32_t position = 0;
+        for (int s = 0; s < 256; s++) {
+            for (int i = 0; i < normalized[s]; i++) {
+                spread[position] = (unsigned char)s;
+                position = (position + step) & (size - 1);
+            }
+        }
+    }
+
+public:
+    FseCodec() : tableLog(MIN_TABLE_LOG), symbolCount(0) {
+        memset(normalized, 0, sizeof(normalized));
+    }
+
+    uint64_t prepare(const uint64_t frequency[256]) override {
+        {
+            StageTimer timer(stats, STAGE_TREE);
+            normalize(frequency);
+        }
+        if (symbolCount == 0) {
+            return 16;
+        }
+
+        StageTimer timer(stats, STAGE_CODEGEN);
+        uint32_t size = 1u << tableLog;
+        unsigned char spread[1 << MAX_TABLE_LOG];
+        spreadSymbols(spread);
+
+        // Each symbol's states in table order, starting at its cumulative count
+        uint32_t next[256];
+        uint32_t cumulative = 0;
+        for (int s = 0; s < 256; s++) {
+            next[s] = cumulative;
+            if (normalized[s] > 0) {
+                int maxBits = tableLog - highBit(normalized[s]);
+                transform[s].maxBits = maxBits;
+                transform[s].threshold = uint32_t(normalized[s]) << maxBits;
+                transform[s].stateOffset = int(cumulative) - normalized[s];
+            }
+            cumulative += normalized[s];
+        }
+        for (uint32_t u = 0; u < size; u++) {
+            encodeStates[next[spread[u]]++] = uint16_t(size + u);
+        }
+
+        double bits = 16 + 8 + 24.0 * symbolCount + tableLog;
+        for (int s = 0; s < 256; s++) {
+            if (frequency[s] > 0) {
+                bits += double(frequency[s]) * (tableLog - log2(double(normalized[s])));
+            }
+        }
+        return uint64_t(bits);
+    }
+
+    // [uint16 symbol count][uint8 table log][(uint8 symbol, uint16 count)...]
+    void writeTable(vector<unsigned char>& out) const override {
+        appendValue<uint16_t>(out, uint16_t(symbolCount));
+        if (symbolCount == 0) {
+            return;
+        }
+        appendValue<unsigned char>(out, (unsigned char)tableLog);
+        for (int s = 0; s < 256; s++) {
+            if (normalized[s] > 0) {
+                appendValue<unsigned char>(out, (unsigned char)s);
+                appendValue<uint16_t>(out, normalized[s]);
+            }
+        }
+    }
+
+    bool encode(const unsigned char* data, size_t size, vector<unsigned char>& out) override {
+        chunks.resize(size);
+        uint32_t state = 1u << tableLog;
+        for (size_t i = size; i-- > 0;) {
+            if (normalized[data[i]] == 0) {
+                return false;
+            }
+            const SymbolTransform& symbol = transform[data[i]];
+            int bits = symbol.maxBits - (state < symbol.threshold ? 1 : 0);
+            chunks[i] = uint16_t((bits << 12) | (state & ((1u << bits) - 1)));
+            state = encodeStates[int(state >> bits) + symbol.stateOffset];
+        }
+
+        BitWriter writer(out);
+        writer.write(state - (1u << tableLog), tableLog);
+        for (size_t i = 0; i < size; i++) {
+            writer.write(chunks[i] & 0xFFF, chunks[i] >> 12);
+        }
+        writer.finish();
+        return true;
+    }
+
+    bool readTable(const unsigned char* data, size_t dataSize, size_t& pos, int& count) override {
+        uint16_t storedCount;
+        if (!readValue(data, dataSize, pos, storedCount) || storedCount > 256) {
+            return false;
+        }
+        count = symbolCount = storedCount;
+        memset(normalized, 0, sizeof(normalized));
+        if (symbolCount == 0) {
+            return true;
+        }
+
+        unsigned char storedLog;
+        if (!readValue(data, dataSize, pos, storedLog) || storedLog < MIN_TABLE_LOG || storedLog > MAX_TABLE_LOG) {
+            return false;
+        }
+        tableLog = storedLog;
+        uint32_t size = 1u << tableLog;
+        uint32_t total = 0;
+        for (int i = 0; i < symbolCount; i++) {
+            unsigned char symbol;
+            uint16_t normal;
+            if (!readValue(data, dataSize, pos, symbol) || !readValue(data, dataSize, pos, normal) ||
+                normal == 0 || normalized[symbol] != 0) {
+                return false;
+            }
+            normalized[symbol] = normal;
+            total += normal;
+        }
+        if (total != size) {
+            return false;
+        }
+
+        unsigned char spread[1 << MAX_TABLE_LOG];
+        spreadSymbols(spread);
+        uint32_t next[256];
+        for (int s = 0; s < 256; s++) {
+            next[s] = normalized[s];
+        }
+        for (uint32_t u = 0; u < size; u++) {
+            unsigned char symbol = spread[u];
+            uint32_t x = next[symbol]++;
+            int bits = tableLog - highBit(x);
+            decodeTable[u].baseState = uint16_t((x << bits) - size);
+            decodeTable[u].symbol = symbol;
+            decodeTable[u].bitCount = (unsigned char)bits;
+        }
+        return true;
+    }
+
+    bool decode(const unsigned char* payload, size_t payloadSize, unsigned char* out, size_t count) override {
+        BitReader reader(payload, payloadSize);
+        reader.refill();
+        uint32_t state = reader.readBits(tableLog);
+
+        // A refill leaves at least 57 bits, enough for four symbols
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            reader.refill();
+            for (int k = 0; k < 4; k++) {
+                const DecodeEntry& entry = decodeTable[state];
+                out[i + k] = entry.symbol;
+                state = entry.baseState + reader.readBits(entry.bitCount);
+            }
+        }
+        for (; i < count; i++) {
+            reader.refill();
+            const DecodeEntry& entry = decodeTable[state];
+            out[i] = entry.symbol;
+            state = entry.baseState + reader.readBits(entry.bitCount);
+        }
+        return !reader.overrun();
+    }
+};
+
+// Largest value code: 12 + bit length of a 32-bit value
+const unsigned char MAX_VALUE_CODE = 12 + 31;
+
+// Length and offset values are sent as a code byte plus raw extra bits:
+// values below 16 are their own code, larger ones send their bit length
+inline unsigned char valueCode(uint32_t value, int& extraCount, uint32_t& extra) {
+    if (value < 16) {
+        extraCount = 0;
+        extra = 0;
+        return (unsigned char)value;
+    }
+    int bits = 0;
+    while ((value >> (bits + 1)) != 0) {
+        bits++;
+    }
+    extraCount = bits;
+    extra = value - (uint32_t(1) << bits);
+    return (unsigned char)(12 + bits);
+}
+
+// Number of extra bits that follow a value code
+inline int valueExtraBits(unsigned char code) {
+    return code < 16 ? 0 : code - 12;
+}
+
+inline uint32_t valueFromCode(unsigned char code, uint32_t extra) {
+    return code < 16 ? code : (uint32_t(1) << (code - 12)) + extra;
+}
+
+// Number of equal bytes at a and b, up to limit
+inline size_t matchLength(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t n = 0;
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (n + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + n, sizeof(x));
+        memcpy(&y, b + n, sizeof(y));
+        if (x != y) {
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        n += 8;
+    }
+#endif
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+// Output of the LZ stage for one block. Each sequence is a run of literals
+// followed by a match; literals after the last match trail the sequences.
+struct LzSequences {
+    vector<unsigned char> literals;
+    vector<unsigned char> literalLengthCodes;
+    vector<unsigned char> matchLengthCodes;
+    vector<unsigned char> offsetCodes;
+    vector<unsigned char> extraBits;    // Per sequence: literal length, match length, offset
+
+    void clear() {
+        literals.clear();
+        literalLengthCodes.clear();
+        matchLengthCodes.clear();
+        offsetCodes.clear();
+        extraBits.clear();
+    }
+};
+
+// Hash-chain match finder over the current block. Levels 1-9 trade chain
+// depth and lazy evaluation for speed; the tables are kept between blocks.
+// Positions are stored offset by a base that moves past each block, so
+// entries left from earlier blocks read as empty without clearing the table.
+class LzMatcher {
+private:
+    static const int HASH_BITS = 16;
+    static const size_t MAX_MATCH = 1 << 16;
+
+    vector<uint32_t> head;  // Most recent position + base for each hash
+    vector<uint32_t> prev;  // Previous position + base with the same hash
+    uint32_t base;          // Stored values below this are from earlier blocks
+    int chainDepth;
+    size_t niceLength;      // Stop searching once a match this long is found
+    bool lazy;              // Check whether the next position has a longer match
+    bool insertAll;         // Index positions inside matches too
+
+    static uint32_t hash(const unsigned char* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    void insert(const unsigned char* data, size_t pos) {
+        uint32_t h = hash(data + pos);
+        prev[pos] = head[h];
+        head[h] = base + uint32_t(pos);
+    }
+
+    // Longest earlier match at pos; 0 if shorter than MIN_MATCH
+    size_t findMatch(const unsigned char* data, size_t size, size_t pos, uint32_t& offset) const {
+        size_t limit = min(size - pos, size_t(MAX_MATCH));
+        size_t best = 0;
+        uint32_t entry = head[hash(data + pos)];
+        for (int depth = chainDepth; entry >= base && depth > 0; depth--) {
+            size_t candidate = entry - base;
+            const unsigned char* match = data + candidate;
+            if (match[best] == data[pos + best]) {
+                size_t length = matchLength(match, data + pos, limit);
+                if (length > best) {
+                    best = length;
+                    offset = uint32_t(pos - candidate);
+                    if (best >= niceLength || best == limit) {
+                        break;
+                    }
+                }
+            }
+            entry = prev[candidate];
+        }
+        return best >= MIN_MATCH ? best : 0;
+    }
+
+    static void emitValue(vector<unsigned char>& codes, BitWriter& extra, uint32_t value) {
+        int extraCount;
+        uint32_t extraValue;
+        codes.push_back(valueCode(value, extraCount, extraValue));
+        if (extraCount > 0) {
+            extra.write(extraValue, extraCount);
+        }
+    }
+
+public:
+    static const size_t MIN_MATCH = 4;
+    static const int MAX_LEVEL = 9;
+
+    LzMatcher() : base(0), chainDepth(0), niceLength(0), lazy(false), insertAll(false) {
+        setLevel(1);
+    }
+
+    void setLevel(int level) {
+        static const int depths[MAX_LEVEL + 1] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
+        static const int niceLengths[MAX_LEVEL + 1] = { 0, 16, 32, 64, 64, 128, 256, 512, 2048, 65536 };
+        level = min(max(level, 1), int(MAX_LEVEL));
+        chainDepth = depths[level];
+        niceLength = size_t(niceLengths[level]);
+        lazy = level >= 4;
+        insertAll = level >= 4;
+    }
+
+    // Split a block into literal runs and back-references
+    void parse(const unsigned char* data, size_t size, LzSequences& seq) {
+        seq.clear();
+        if (head.empty() || base > UINT32_MAX - MAX_BLOCK_SIZE) {
+            head.assign(size_t(1) << HASH_BITS, 0);
+            base = 1;
+        }
+        if (prev.size() < size) {
+            prev.resize(size);
+        }
+        BitWriter extra(seq.extraBits);
+
+        size_t pos = 0;
+        size_t anchor = 0;
+        while (pos + MIN_MATCH <= size) {
+            uint32_t offset = 0;
+            size_t length = findMatch(data, size, pos, offset);
+            insert(data, pos);
+            if (length == 0) {
+                pos++;
+                continue;
+            }
+
+            while (lazy && pos + 1 + MIN_MATCH <= size) {
+                uint32_t nextOffset = 0;
+                size_t nextLength = findMatch(data, size, pos + 1, nextOffset);
+                if (nextLength <= length) {
+                    break;
+                }
+                pos++;
+                insert(data, pos);
+                length = nextLength;
+                offset = nextOffset;
+            }
+
+            seq.literals.insert(seq.literals.end(), data + anchor, data + pos);
+            emitValue(seq.literalLengthCodes, extra, uint32_t(pos - anchor));
+            emitValue(seq.matchLengthCodes, extra, uint32_t(length - MIN_MATCH));
+            emitValue(seq.offsetCodes, extra, offset);
+
+            size_t end = pos + length;
+            if (insertAll) {
+                for (size_t p = pos + 1; p < end && p + MIN_MATCH <= size; p++) {
+                    insert(data, p);
+                }
+            }
+            pos = end;
+            anchor = end;
+        }
+        seq.literals.insert(seq.literals.end(), data + anchor, data + size);
+        extra.finish();
+        base += uint32_t(size);
+    }
+};
+
+// Codes a stream as independent blocks: optional LZ stage, then an entropy
+// coder per block, framed with the stream header and block index
+class BlockCoder {
+private:
+    // One adaptive coder of each kind per sectionFrequency slot, so the code
+    // chooseCodec prepares for a section is still there when it is encoded
+    HuffmanCodec huffman[STATIC_SLOT_COUNT];
+    FseCodec fse[STATIC_SLOT_COUNT];
+    StaticCodec staticCodec;
+    string originalFileExtension;
+    size_t blockSize;
+    bool sampledHistogram;
+    int level;              // 0 = entropy coding only, 1-9 = LZ stage search effort
+    int entropyChoice;      // ENTROPY_HUFFMAN, ENTROPY_FSE, ENTROPY_STATIC or ENTROPY_AUTO
+    int staticTable;        // Pretrained table for ENTROPY_STATIC and ENTROPY_AUTO; -1 for none
+    LzMatcher matcher;
+    LzSequences sequences;
+    uint64_t sectionFrequency[STATIC_SLOT_COUNT][256];   // Slot 0: whole block; 1-4: LZ sections
+    StageStats stageStats;
+
+    // Stream scratch kept between calls, so coding many small streams with one
+    // coder does not allocate per stream
+    vector<unsigned char> streamBlock;
+    vector<unsigned char> streamBody;
+    BlockIndex streamIndex;
+
+    // Helper function to fill a buffer from a stream; returns bytes read
+    size_t readBlock(istream& in, vector<unsigned char>& buffer);
+
+    // Helper function to read the rest of a file into memory
+    vector<unsigned char> readRemaining(ifstream& inFile);
+
+    // Helper function to count symbols, sampling if enabled and allowed
+    void countSymbols(const unsigned char* data, size_t size, uint64_t frequency[256], bool maySample = true) {
+        StageTimer timer(&stageStats, STAGE_HISTOGRAM, size);
+        if (sampledHistogram && maySample) {
+            countBytesSampled(data, size, frequency);
+        } else {
+            countBytes(data, size, frequency);
+        }
+    }
+
+    // Helper function to check a block's histogram for redundancy. The order-0
+    // entropy plus the smallest table (Huffman code lengths, about half a byte
+    // per symbol) bounds what the adaptive entropy coders can reach,
+    // so a block that fails this is stored without a coding attempt. The LZ
+    // stage could still find repeats in such a block, but in practice flat
+    // histograms come from compressed or encrypted data that has none.
+    static bool worthCoding(const uint64_t frequency[256], size_t size) {
+        uint64_t total = 0;
+        int symbols = 0;
+        for (int c = 0; c < 256; c++) {
+            total += frequency[c];
+            if (frequency[c] > 0) symbols++;
+        }
+        if (total == 0) {
+            return false;
+        }
+
+        double bits = 0;
+        for (int c = 0; c < 256; c++) {
+            if (frequency[c] > 0) {
+                bits += double(frequency[c]) * log2(double(total) / double(frequency[c]));
+            }
+        }
+        double estimate = bits / double(total) * double(size) / 8 + 0.5 * symbols + 8;
+        return estimate < double(size);
+    }
+
+    // Helper function to check whether the static table, which costs no table
+    // bytes, would shrink a block that fails worthCoding
+    bool staticTableFits(const uint64_t frequency[256], size_t size) {
+        return staticTable >= 0 && staticCodec.select(staticTable, 0) &&
+               staticCodec.prepare(frequency) / 8 < size;
+    }
+
+    // Helper function to write a block body as a raw copy
+    static void storeBlock(const unsigned char* data, size_t size, vector<unsigned char>& body) {
+        appendValue<unsigned char>(body, CODEC_STORED);
+        body.insert(body.end(), data, data + size);
+    }
+
+    // Helper function to look up an entropy coder by ID
+    EntropyCodec* getCodec(int id, int slot = 0) {
+        if (id == ENTROPY_HUFFMAN) return &huffman[slot];
+        if (id == ENTROPY_FSE) return &fse[slot];
+        if (id == ENTROPY_STATIC) return &staticCodec;
+        return NULL;
+    }
+
+    // Helper function to pick the coder for a block's symbol streams, counted
+    // in sectionFrequency slots firstSlot onwards; bits is the coded size
+    // estimate, tables included. Leaves the chosen adaptive coder prepared in
+    // each slot, so only the static codec, whose prepare is a table lookup,
+    // is prepared again before encoding.
+    int chooseCodec(int sectionCount, int firstSlot, uint64_t& bits) {
+        uint64_t huffmanBits = 0;
+        uint64_t fseBits = 0;
+        uint64_t staticBits = 0;
+        bool tryHuffman = (entropyChoice == ENTROPY_AUTO || entropyChoice == ENTROPY_HUFFMAN);
+        bool tryFse = (entropyChoice == ENTROPY_AUTO || entropyChoice == ENTROPY_FSE);
+        bool tryStatic = staticTable >= 0 && (entropyChoice == ENTROPY_AUTO || entropyChoice == ENTROPY_STATIC);
+        for (int i = firstSlot; i < firstSlot + sectionCount; i++) {
+            huffmanBits += tryHuffman ? huffman[i].prepare(sectionFrequency[i]) : 0;
+            fseBits += tryFse ? fse[i].prepare(sectionFrequency[i]) : 0;
+            if (tryStatic && staticBits != UINT64_MAX) {
+                staticCodec.select(staticTable, i);
+                uint64_t sectionBits = staticCodec.prepare(sectionFrequency[i]);
+                staticBits = (sectionBits == UINT64_MAX) ? sectionBits : staticBits + sectionBits;
+            }
+        }
+        if (entropyChoice != ENTROPY_AUTO) {
+            bits = (entropyChoice == ENTROPY_HUFFMAN) ? huffmanBits :
+                   (entropyChoice == ENTROPY_FSE) ? fseBits : staticBits;
+            return entropyChoice;
+        }
+        int best = fseBits < huffmanBits ? ENTROPY_FSE : ENTROPY_HUFFMAN;
+        bits = min(huffmanBits, fseBits);
+        if (tryStatic && staticBits < bits) {
+            best = ENTROPY_STATIC;
+            bits = staticBits;
+        }
+        return best;
+    }
+
+    // Helper function to get the coder chooseCodec picked for a slot, ready to encode
+    EntropyCodec* preparedCodec(int codec, int slot) {
+        if (codec == ENTROPY_STATIC) {
+            staticCodec.select(staticTable, slot);
+            staticCodec.prepare(sectionFrequency[slot]);
+        }
+        return getCodec(codec, slot);
+    }
+
+    // Helper function to code a symbol stream with a prepared coder as
+    // [table][uint32 payload size][payload]
+    bool encodeSection(EntropyCodec& codec, const vector<unsigned char>& symbols, vector<unsigned char>& out) {
+        codec.writeTable(out);
+
+        size_t sizePos = out.size();
+        appendValue<uint32_t>(out, 0);
+        if (symbols.empty()) {
+            return true;
+        }
+
+        bool encoded;
+        {
+            StageTimer timer(&stageStats, STAGE_ENCODE, symbols.size());
+            encoded = codec.encode(symbols.data(), symbols.size(), out);
+        }
+        uint32_t payloadSize = uint32_t(out.size() - sizePos - sizeof(uint32_t));
+        memcpy(&out[sizePos], &payloadSize, sizeof(payloadSize));
+        return encoded;
+    }
+
+    bool decodeSection(EntropyCodec& codec, const unsigned char* body, size_t bodySize, size_t& pos,
+                       vector<unsigned char>& symbols, size_t count) {
+        int symbolCount;
+        uint32_t payloadSize;
+        if (!codec.readTable(body, bodySize, pos, symbolCount) ||
+            !readValue(body, bodySize, pos, payloadSize) || bodySize - pos < payloadSize ||
+            (symbolCount == 0) != (count == 0)) {
+            return false;
+        }
+
+        symbols.resize(count);
+        if (count > 0 && !codec.decode(body + pos, payloadSize, symbols.data(), count)) {
+            return false;
+        }
+        pos += payloadSize;
+        return true;
+    }
+
+    // Helper function to read a length or offset given its code
+    static bool readCodedValue(BitReader& reader, unsigned char code, uint32_t& value) {
+        if (code > MAX_VALUE_CODE) {
+            return false;
+        }
+        reader.refill();
+        value = valueFromCode(code, reader.readBits(valueExtraBits(code)));
+        return !reader.overrun();
+    }
+
+    // LZ block: [uint32 sequences][uint32 literals], entropy coded sections
+    // for the literals, literal length, match length and offset codes, then
+    // [uint32 size][extra bits]
+    // Helper function to run the LZ stage over a block and count its
+    // sections into slots 1-4; returns the estimated body size in bits
+    uint64_t parseLzBlock(const unsigned char* data, size_t size, int& codec) {
+        {
+            StageTimer timer(&stageStats, STAGE_MATCH, size);
+            matcher.parse(data, size, sequences);
+        }
+        const vector<unsigned char>* sections[4] = {
+            &sequences.literals, &sequences.literalLengthCodes,
+            &sequences.matchLengthCodes, &sequences.offsetCodes
+        };
+        // Only the literals may be sampled: the code sections are small, and
+        // the sampled floor would give every one of their 256 symbols a code
+        for (int i = 0; i < 4; i++) {
+            memset(sectionFrequency[1 + i], 0, sizeof(sectionFrequency[1 + i]));
+            if (!sections[i]->empty()) {
+                countSymbols(sections[i]->data(), sections[i]->size(), sectionFrequency[1 + i], i == 0);
+            }
+        }
+
+        // Codec byte, sequence and literal counts, four payload sizes, then the extra bits
+        uint64_t bits;
+        codec = chooseCodec(4, 1, bits);
+        uint64_t framing = 1 + 2 * sizeof(uint32_t) + 5 * sizeof(uint32_t) + sequences.extraBits.size();
+        return bits == UINT64_MAX ? bits : bits + 8 * framing;
+    }
+
+    // Helper function to write the block parseLzBlock counted
+    bool compressLzBlock(int codec, vector<unsigned char>& body) {
+        const vector<unsigned char>* sections[4] = {
+            &sequences.literals, &sequences.literalLengthCodes,
+            &sequences.matchLengthCodes, &sequences.offsetCodes
+        };
+        appendValue<unsigned char>(body, (unsigned char)((codec << 1) | CODEC_LZ));
+        appendValue<uint32_t>(body, uint32_t(sequences.offsetCodes.size()));
+        appendValue<uint32_t>(body, uint32_t(sequences.literals.size()));
+        for (int i = 0; i < 4; i++) {
+            if (!encodeSection(*preparedCodec(codec, 1 + i), *sections[i], body)) {
+                return false;
+            }
+        }
+        appendValue<uint32_t>(body, uint32_t(sequences.extraBits.size()));
+        body.insert(body.end(), sequences.extraBits.begin(), sequences.extraBits.end());
+        return true;
+    }
+
+    bool decompressLzBlock(EntropyCodec& codec, const unsigned char* body, size_t bodySize,
+                           unsigned char* out, size_t rawSize) {
+        size_t pos = 0;
+        uint32_t sequenceCount, literalCount, extraSize;
+        if (!readValue(body, bodySize, pos, sequenceCount) || !readValue(body, bodySize, pos, literalCount) ||
+            sequenceCount > rawSize || literalCount > rawSize ||
+            !decodeSection(codec, body, bodySize, pos, sequences.literals, literalCount) ||
+            !decodeSection(codec, body, bodySize, pos, sequences.literalLengthCodes, sequenceCount) ||
+            !decodeSection(codec, body, bodySize, pos, sequences.matchLengthCodes, sequenceCount) ||
+            !decodeSection(codec, body, bodySize, pos, sequences.offsetCodes, sequenceCount) ||
+            !readValue(body, bodySize, pos, extraSize) || bodySize - pos < extraSize) {
+            return false;
+        }
+
+        BitReader extra(body + pos, extraSize);
+        const unsigned char* literals = sequences.literals.data();
+        size_t outPos = 0;
+        size_t literalPos = 0;
+        for (uint32_t i = 0; i < sequenceCount; i++) {
+            uint32_t literalLength, matchValue, offset;
+            if (!readCodedValue(extra, sequences.literalLengthCodes[i], literalLength) ||
+                !readCodedValue(extra, sequences.matchLengthCodes[i], matchValue) ||
+                !readCodedValue(extra, sequences.offsetCodes[i], offset)) {
+                return false;
+            }
+            size_t matchLength = size_t(matchValue) + LzMatcher::MIN_MATCH;
+            if (literalLength > literalCount - literalPos || literalLength > rawSize - outPos) {
+                return false;
+            }
+            memcpy(out + outPos, literals + literalPos, literalLength);
+            outPos += literalLength;
+            literalPos += literalLength;
+
+            if (offset == 0 || offset > outPos || matchLength > rawSize - outPos) {
+                return false;
+            }
+            const unsigned char* source = out + outPos - offset;
+            if (offset >= matchLength) {
+                memcpy(out + outPos, source, matchLength);
+            } else {
+                for (size_t j = 0; j < matchLength; j++) {
+                    out[outPos + j] = source[j];
+                }
+            }
+            outPos += matchLength;
+        }
+
+        size_t trailing = literalCount - literalPos;
+        if (trailing != rawSize - outPos) {
+            return false;
+        }
+        memcpy(out + outPos, literals + literalPos, trailing);
+        return true;
+    }
+
+    // Helper function to decode the older single-table format
+    bool decompressLegacy(ifstream& inFile, ofstream& outFile);
+
+public:
+    BlockCoder()
+        : blockSize(DEFAULT_BLOCK_SIZE), sampledHistogram(false), level(0), entropyChoice(ENTROPY_AUTO),
+          staticTable(-1) {
+        for (int slot = 0; slot < STATIC_SLOT_COUNT; slot++) {
+            huffman[slot].setStats(&stageStats);
+            fse[slot].setStats(&stageStats);
+        }
+    }
+
+    // The codecs record into this coder's counters, so it cannot be copied
+    BlockCoder(const BlockCoder&) = delete;
+    BlockCoder& operator=(const BlockCoder&) = delete;
+
+    // Time spent per stage by this coder since it was created or cleared
+    StageStats& getStageStats() {
+        return stageStats;
+    }
+
+    // Set the number of input bytes coded per block
+    bool setBlockSize(size_t size) {
+        if (size == 0 || size > MAX_BLOCK_SIZE) {
+            return false;
+        }
+        blockSize = size;
+        return true;
+    }
+
+    size_t getBlockSize() const {
+        return blockSize;
+    }
+
+    // Estimate block histograms from a sample instead of counting every byte
+    void setSampledHistogram(bool enabled) {
+        sampledHistogram = enabled;
+    }
+
+    // Select the entropy coder, or ENTROPY_AUTO to estimate each per block.
+    // ENTROPY_STATIC needs a table from setStaticTable.
+    bool setEntropyCodec(int id) {
+        if (id != ENTROPY_AUTO && id != ENTROPY_HUFFMAN && id != ENTROPY_FSE &&
+            (id != ENTROPY_STATIC || staticTable < 0)) {
+            return false;
+        }
+        entropyChoice = id;
+        return true;
+    }
+
+    // Offer a pretrained table (an index into STATIC_TABLES) to ENTROPY_AUTO,
+    // or -1 to stop using one
+    bool setStaticTable(int table) {
+        if (table < -1 || table >= STATIC_TABLE_COUNT || (table < 0 && entropyChoice == ENTROPY_STATIC)) {
+            return false;
+        }
+        staticTable = table;
+        return true;
+    }
+
+    // Set the compression level: 0 codes bytes directly, 1-9 run the LZ stage first
+    bool setLevel(int value) {
+        if (value < 0 || value > LzMatcher::MAX_LEVEL) {
+            return false;
+        }
+        level = value;
+        matcher.setLevel(value);
+        return true;
+    }
+
+    // Compress one block into its body: codec byte followed by the codec's data.
+    // From level 1 the LZ stage is kept only where it is estimated to beat
+    // coding the bytes directly. Blocks that would not shrink are stored as they are.
+    bool compressBlock(const unsigned char* data, size_t size, vector<unsigned char>& body) {
+        // A forced static table at level 0 needs no histogram; the size check
+        // below still catches data the table does not fit
+        bool fixedTable = (entropyChoice == ENTROPY_STATIC && level == 0);
+        if (!fixedTable) {
+            memset(sectionFrequency[0], 0, sizeof(sectionFrequency[0]));
+            countSymbols(data, size, sectionFrequency[0]);
+            if (!worthCoding(sectionFrequency[0], size) && !staticTableFits(sectionFrequency[0], size)) {
+                storeBlock(data, size, body);
+                return true;
+            }
+        }
+
+        size_t start = body.size();
+        bool coded = true;
+        int codec = ENTROPY_STATIC;
+        uint64_t plainBits = UINT64_MAX;
+        if (!fixedTable) {
+            codec = chooseCodec(1, 0, plainBits);
+        }
+        int lzCodec;
+        if (level > 0 && parseLzBlock(data, size, lzCodec) < plainBits) {
+            if (!compressLzBlock(lzCodec, body)) {
+                return false;
+            }
+        } else {
+            // A fixed table is selected but not prepared: there is no histogram
+            EntropyCodec* entropy = fixedTable ? getCodec(codec) : preparedCodec(codec, 0);
+            if (fixedTable) {
+                staticCodec.select(staticTable, 0);
+            }
+            appendValue<unsigned char>(body, (unsigned char)(codec << 1));
+            entropy->writeTable(body);
+            StageTimer timer(&stageStats, STAGE_ENCODE, size);
+            coded = entropy->encode(data, size, body);
+            if (!coded && !fixedTable) {
+                return false;
+            }
+        }
+
+        // Keep the coded body only if it beats a stored copy
+        if (!coded || body.size() - start > size) {
+            body.resize(start);
+            storeBlock(data, size, body);
+        }
+        return true;
+    }
+
+    // Decompress one block body into rawSize bytes at out. Version 1 streams
+    // have no codec byte and are always Huffman coded.
+    bool decompressBlock(const unsigned char* body, size_t bodySize, unsigned char* out, size_t rawSize,
+                         unsigned char version = STREAM_VERSION) {
+        StageTimer timer(&stageStats, STAGE_DECODE, rawSize);
+        size_t pos = 0;
+        unsigned char codec = (unsigned char)(ENTROPY_HUFFMAN << 1);
+        if (version >= 2 && !readValue(body, bodySize, pos, codec)) {
+            return false;
+        }
+        if (codec == CODEC_STORED) {
+            if (bodySize - pos != rawSize) {
+                return false;
+            }
+            memcpy(out, body + pos, rawSize);
+            return true;
+        }
+        EntropyCodec* entropy = getCodec(codec >> 1);
+        if (!entropy || (version < 3 && entropy == &staticCodec)) {
+            return false;
+        }
+        huffman[0].setWeightTables(version < 3);
+        if (codec & CODEC_LZ) {
+            return decompressLzBlock(*entropy, body + pos, bodySize - pos, out, rawSize);
+        }
+
+        int symbolCount;
+        if (!entropy->readTable(body, bodySize, pos, symbolCount) || symbolCount == 0) {
+            return false;
+        }
+        return entropy->decode(body + pos, bodySize - pos, out, rawSize);
+    }
+
+    // Stream header bytes before the extension: magic, version and extension length
+    static const size_t HEADER_SIZE = sizeof(STREAM_MAGIC) + 2;
+
+    // Parse the first HEADER_SIZE bytes of a stream; false if it is not in block format
+    static bool parseStreamHeader(const unsigned char* data, unsigned char& version, size_t& extensionSize);
+
+    // Size of the stream header written for an extension
+    static size_t streamHeaderSize(const string& extension) {
+        return HEADER_SIZE + min<size_t>(extension.length(), 255);
+    }
+
+    // Write the stream header to streamHeaderSize(extension) bytes at out
+    static void storeStreamHeader(unsigned char* out, const string& extension);
+
+    // Read the stream header; false if the stream is not in block format
+    static bool readStreamHeader(istream& in, string& extension, unsigned char& version);
+
+    static bool readStreamHeader(istream& in, string& extension) {
+        unsigned char version;
+        return readStreamHeader(in, extension, version);
+    }
+
+    // Write the stream header: magic, version and original extension; returns its size
+    static size_t writeStreamHeader(ostream& out, const string& extension);
+
+    // Frame header for a coded block, with its checksums; rawCrc is the CRC32C
+    // of the uncompressed block (of the whole stream for the end frame)
+    static BlockFrame makeFrame(size_t rawSize, uint32_t rawCrc, const vector<unsigned char>& body);
+
+    // Check a frame's CRC against its body; always true before stream version 4
+    static bool checkFrame(const BlockFrame& frame, const unsigned char* body, unsigned char version);
+
+    // Check the end-of-stream frame against the CRC of all the blocks before it
+    static bool checkStreamEnd(const BlockFrame& frame, unsigned char version, uint32_t streamCrc);
+
+    // Write a frame header to frameHeaderSize(STREAM_VERSION) bytes at out
+    static void storeFrame(unsigned char* out, const BlockFrame& frame);
+
+    // Write one framed block; a zero-size frame marks the end of the stream
+    static bool writeBlock(ostream& out, const BlockFrame& frame, const vector<unsigned char>& body);
+
+    // Parse and validate frameHeaderSize(version) bytes of block frame header;
+    // rawSize is 0 at the end of the stream. Checksums read as 0 before stream version 4.
+    static bool parseBlockHeader(const unsigned char* data, unsigned char version, BlockFrame& frame);
+
+    // Read and validate a block frame header
+    static bool readBlockHeader(istream& in, unsigned char version, BlockFrame& frame);
+
+    // Compress one block into body and build its frame
+    bool compressFrame(const unsigned char* data, size_t size, vector<unsigned char>& body, BlockFrame& frame);
+
+    // Check a frame against its body, decode it into frame.rawSize bytes at out
+    // and fold its CRC into streamCrc; false, with the error printed, on damage
+    bool decodeFrame(const BlockFrame& frame, const unsigned char* body, unsigned char* out,
+                     unsigned char version, uint32_t& streamCrc);
+
+    // Largest stream compressBuffer can produce from size bytes in blocks of
+    // blockSize: every block stored, plus header, frames and block index
+    static size_t compressBound(size_t size, size_t blockSize = DEFAULT_BLOCK_SIZE);
+
+    // Compress a buffer into out as a complete stream, in the same format as
+    // compressStream; written is its size. compressBound(size, getBlockSize())
+    // bytes of capacity are always enough.
+    bool compressBuffer(const unsigned char* data, size_t size, unsigned char* out, size_t capacity,
+                        size_t& written);
+
+    // Decompress a stream held in memory straight into out; false if it is
+    // damaged or its data does not fit in capacity
+    bool decompressBuffer(const unsigned char* data, size_t size, unsigned char* out, size_t capacity,
+                          size_t& written);
+
+    // Uncompressed size of a stream held in memory, from its block index;
+    // false if it has none
+    static bool getUncompressedSize(const unsigned char* data, size_t size, uint64_t& result);
+
+    // Compress a stream block by block in constant memory; works on pipes
+    bool compressStream(istream& in, ostream& out, const string& extension);
+
+    // Decompress a block-format stream, checking block and stream checksums; works on pipes
+    bool decompressStream(istream& in, ostream& out);
+
+    // Decompress length bytes starting at an uncompressed offset, decoding
+    // only the blocks that cover them. Needs a seekable stream with a block index.
+    bool decompressRange(istream& in, uint64_t offset, uint64_t length, ostream& out);
+
+    // Uncompressed size from the block index; false if the stream has none
+    static bool getUncompressedSize(istream& in, uint64_t& size);
+
+    // Compress a file
+    bool compressFile(const string& inputFile, const string& outputFile);
+
+    // Decompress a file, in block format or the older single-table format
+    bool decompressFile(const string& inputFile, const string& outputFile);
+
+    // Get the Huffman codes from the last block whose bytes were Huffman coded directly, indexed by byte value
+    const array<HuffmanCode, 256>& getHuffmanCodes() const {
+        return huffman[0].getHuffmanCodes();
+    }
+};
+
+// Push/pull compression for data that arrives in chunks, such as a request
+// body read from a socket. Input is gathered into blocks and each block is
+// coded as it fills; a full block waits while coded bytes are still to be
+// pulled, so memory stays at about two blocks. Buffers are reused across
+// streams, so one context per thread codes any number of them without
+// allocating per call.
+class CompressContext {
+private:
+    BlockCoder coder;
+    vector<unsigned char> block;    // Input gathered for the next block
+    size_t blockFill;
+    vector<unsigned char> body;
+    vector<unsigned char> pending;  // Coded bytes not yet pulled
+    size_t pendingPos;
+    BlockIndex index;
+    uint32_t streamCrc;
+    bool ended;
+    bool failed;
+
+    bool drained() const {
+        return pendingPos == pending.size();
+    }
+
+    // Helper function to drop pulled output before queueing more
+    void compact() {
+        if (drained()) {
+            pending.clear();
+            pendingPos = 0;
+        }
+    }
+
+    // Helper function to code one block onto the pending output
+    bool codeBlock(const unsigned char* data, size_t size);
+
+public:
+    CompressContext() {
+        begin();
+    }
+
+    // Coder settings; a new block size takes effect at the next begin
+    BlockCoder& getCoder() {
+        return coder;
+    }
+
+    // Start a new stream; its header is the first output pulled
+    void begin(const string& extension = string());
+
+    // Take input; consumed falls short of size while a full block waits for
+    // output to be pulled. False if the stream has ended or coding failed.
+    bool push(const unsigned char* data, size_t size, size_t& consumed);
+
+    // End the input: code the last partial block and queue the end frame and block index
+    bool end();
+
+    // Copy up to capacity coded bytes to out; returns how many
+    size_t pull(unsigned char* out, size_t capacity);
+
+    // True once the stream has ended and all of it has been pulled
+    bool done() const {
+        return ended && drained();
+    }
+};
+
+// Push/pull decompression for streams that arrive in chunks. Frames are
+// gathered until complete, then decoded one block at a time; a frame that
+// arrives whole in one push is decoded where it lies. Input stops being taken
+// while a decoded block waits to be pulled. Checksums are checked per block
+// and at the end of the stream; the block index after it is skipped.
+class DecompressContext {
+private:
+    // What the next input bytes belong to
+    enum Part { PART_HEADER, PART_EXTENSION, PART_FRAME, PART_BODY, PART_TRAILER };
+
+    BlockCoder coder;
+    Part part;
+    size_t needed;                  // Size of the current part
+    vector<unsigned char> input;    // Current part, when it is split across pushes
+    unsigned char version;
+    BlockFrame frame;
+    uint32_t streamCrc;
+    vector<unsigned char> block;    // Decoded block not yet pulled
+    size_t blockPos;
+    bool failed;
+
+    // Helper function to act on a complete part
+    bool takePart(const unsigned char* data);
+
+public:
+    DecompressContext() {
+        begin();
+    }
+
+    // Start reading a new stream
+    void begin();
+
+    // Take input; consumed falls short of size while decoded data waits to
+    // be pulled. False, with the error printed, if the stream is damaged.
+    bool push(const unsigned char* data, size_t size, size_t& consumed);
+
+    // Copy up to capacity decoded bytes to out; returns how many
+    size_t pull(unsigned char* out, size_t capacity);
+
+    // True once the end of the stream has been checked and all data pulled
+    bool done() const {
+        return part == PART_TRAILER && blockPos == block.size();
+    }
+};
+
+// Fixed set of worker threads pulling tasks from a shared queue. Each task
+// receives the index of the worker running it, for per-worker state.
+class ThreadPool {
+private:
+    vector<thread> workers;
+    queue<function<void(int)>> tasks;
+    mutex queueLock;
+    condition_variable wake;
+    bool stopping;
+
+    void workerLoop(int index) {
+        while (true) {
+            function<void(int)> task;
+            {
+                unique_lock<mutex> lock(queueLock);
+                wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop();
+            }
+            task(index);
+        }
+    }
+
+public:
+    explicit ThreadPool(int threadCount) : stopping(false) {
+        for (int i = 0; i < threadCount; i++) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
+
+    // Finishes queued tasks before joining
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(queueLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    future<bool> submit(function<bool(int)> task) {
+        auto packaged = make_shared<packaged_task<bool(int)>>(move(task));
+        future<bool> result = packaged->get_future();
+        {
+            lock_guard<mutex> lock(queueLock);
+            tasks.push([packaged](int worker) { (*packaged)(worker); });
+        }
+        wake.notify_one();
+        return result;
+    }
+
+    int size() const {
+        return int(workers.size());
+    }
+};
+
+// Shared between a running engine and whoever watches it: byte counters
+// updated once per block, and a cancellation flag the engine checks
+// before reading each block
+class JobProgress {
+private:
+    atomic<uint64_t> bytesIn;
+    atomic<uint64_t> bytesOut;
+    atomic<bool> cancelled;
+    function<void(uint64_t, uint64_t)> callback;
+
+public:
+    JobProgress() : bytesIn(0), bytesOut(0), cancelled(false) {}
+
+    // Called on the engine's thread after each block with the running totals
+    void setCallback(function<void(uint64_t, uint64_t)> onBlock) {
+        callback = move(onBlock);
+    }
+
+    void add(uint64_t in, uint64_t out) {
+        uint64_t totalIn = bytesIn += in;
+        uint64_t totalOut = bytesOut += out;
+        if (callback) {
+            callback(totalIn, totalOut);
+        }
+    }
+
+    void cancel() {
+        cancelled = true;
+    }
+
+    bool isCancelled() const {
+        return cancelled;
+    }
+
+    uint64_t getBytesIn() const {
+        return bytesIn;
+    }
+
+    uint64_t getBytesOut() const {
+        return bytesOut;
+    }
+};
+
+// Size of one block before and after coding
+struct BlockStat {
+    uint32_t rawSize;
+    uint32_t bodySize;
+};
+
+// Where one engine run spent its time: stage counters merged from the
+// reader, the writer and every worker, and each block's sizes in stream
+// order. Empty when FILEZIPPER_STATS is off.
+struct RunStats {
+    StageStats stages;
+    vector<BlockStat> blocks;
+    int threads;
+    double wallSeconds;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+
+    RunStats() : threads(0), wallSeconds(0.0), bytesIn(0), bytesOut(0) {}
+
+    // "io" if reading or writing took longer than the coding work spread
+    // over the workers, else "cpu"
+    const char* bottleneck() const;
+
+    void writeJson(ostream& out) const;
+};
+
+// Block-parallel compression engine. Blocks are read in order on a reader
+// thread, coded concurrently by workers that each own a BlockCoder
+// (histograms, match finder and entropy coders), and written back in order,
+// so the output is the same block stream BlockCoder produces single-threaded.
+class ParallelEngine {
+private:
+    int threadCount;
+    size_t blockSize;
+    bool sampledHistogram;
+    int level;
+    int entropyChoice;
+    int staticTable;
+    JobProgress* progress;
+    RunStats lastStats;
+
+    // One in-flight block; a ring of these bounds memory use
+    struct Slot {
+        vector<unsigned char> input;
+        vector<unsigned char> output;
+        size_t rawSize;
+        BlockFrame frame;
+        const char* error;      // Why a block failed to decode or verify
+        future<bool> done;
+    };
+
+    // Three-stage pipeline over a ring of 2 x threads reusable slots: a reader
+    // thread fills slots in order, the pool codes them, and the calling
+    // thread writes them back in order, so reads, coding and writes overlap.
+    // readSlot returns false at end of input; cancelled reports a stop
+    // requested through the progress tracker.
+    bool runPipeline(const function<bool(Slot&)>& readSlot, const function<bool(Slot&, int)>& codeSlot,
+                     const function<bool(Slot&)>& writeSlot, bool& cancelled);
+
+    // Helper function to fill lastStats at the end of a run from the reader's,
+    // writer's and workers' counters
+    void finishStats(chrono::steady_clock::time_point start, const StageStats& reader,
+                     const StageStats& writer, const vector<unique_ptr<BlockCoder>>& coders, bool compressing);
+
+    // Shared decode loop: checks frame CRCs, then unless decoding is off
+    // decodes each block and checks its raw CRC, writing to out when given,
+    // and finally checks the whole-stream CRC. label prefixes error messages.
+    bool decodeStream(istream& in, ostream* out, bool decode, const char* label);
+
+public:
+    explicit ParallelEngine(int threads = 0)
+        : threadCount(1), blockSize(DEFAULT_BLOCK_SIZE), sampledHistogram(false), level(0),
+          entropyChoice(ENTROPY_AUTO), staticTable(-1), progress(NULL) {
+        setThreadCount(threads);
+    }
+
+    // Set the worker count; 0 uses one per hardware thread
+    void setThreadCount(int threads) {
+        if (threads <= 0) {
+            threads = int(thread::hardware_concurrency());
+        }
+        threadCount = max(threads, 1);
+    }
+
+    int getThreadCount() const {
+        return threadCount;
+    }
+
+    bool setBlockSize(size_t size) {
+        if (size == 0 || size > MAX_BLOCK_SIZE) {
+            return false;
+        }
+        blockSize = size;
+        return true;
+    }
+
+    size_t getBlockSize() const {
+        return blockSize;
+    }
+
+    void setSampledHistogram(bool enabled) {
+        sampledHistogram = enabled;
+    }
+
+    bool setLevel(int value) {
+        if (value < 0 || value > LzMatcher::MAX_LEVEL) {
+            return false;
+        }
+        level = value;
+        return true;
+    }
+
+    int getLevel() const {
+        return level;
+    }
+
+    // ENTROPY_STATIC needs a table from setStaticTable
+    bool setEntropyCodec(int id) {
+        if (id != ENTROPY_AUTO && id != ENTROPY_HUFFMAN && id != ENTROPY_FSE &&
+            (id != ENTROPY_STATIC || staticTable < 0)) {
+            return false;
+        }
+        entropyChoice = id;
+        return true;
+    }
+
+    bool setStaticTable(int table) {
+        if (table < -1 || table >= STATIC_TABLE_COUNT || (table < 0 && entropyChoice == ENTROPY_STATIC)) {
+            return false;
+        }
+        staticTable = table;
+        return true;
+    }
+
+    // Stage timings and block sizes of the last stream compressed, decompressed
+    // or verified with this engine
+    const RunStats& getLastStats() const {
+        return lastStats;
+    }
+
+    // Report per-block progress to, and take cancellation from, a caller-owned
+    // tracker; NULL disables both
+    void setProgress(JobProgress* tracker) {
+        progress = tracker;
+    }
+
+    // Settings that change the compressed output, packed so runs can be compared
+    uint64_t getSettingsKey() const {
+        return uint64_t(blockSize) << 24 | uint64_t(sampledHistogram) << 23 | uint64_t(level) << 16 |
+               uint64_t(entropyChoice + 1) << 8 | uint64_t(staticTable + 1);
+    }
+
+    // A coder with this engine's settings, for work outside the engine's own pool
+    unique_ptr<BlockCoder> createCoder() const {
+        unique_ptr<BlockCoder> coder(new BlockCoder());
+        coder->setBlockSize(blockSize);
+        coder->setSampledHistogram(sampledHistogram);
+        coder->setLevel(level);
+        coder->setStaticTable(staticTable);
+        coder->setEntropyCodec(entropyChoice);
+        return coder;
+    }
+
+    // contentHash, if given, receives the xxHash64 of the input, computed by
+    // the reader as it goes so the input is read only once
+    bool compressStream(istream& in, ostream& out, const string& extension, uint64_t* contentHash = NULL);
+
+    bool decompressStream(istream& in, ostream& out);
+
+    // Check a stream's checksums without writing anything. The fast check
+    // reads every frame and compares frame CRCs in parallel without decoding;
+    // fullDecode also decodes each block and checks the uncompressed data.
+    // Streams before version 4 have no checksums and need fullDecode.
+    bool verifyStream(istream& in, bool fullDecode);
+
+    bool compressFile(const string& inputFile, const string& outputFile, uint64_t* contentHash = NULL);
+
+    bool verifyFile(const string& inputFile, bool fullDecode);
+
+    // Decompress a file; the older single-table format is decoded serially
+    bool decompressFile(const string& inputFile, const string& outputFile);
+};
+
+// One file stored in an archive
+struct ArchiveEntry {
+    string name;                // Relative path with '/' separators
+    uint64_t originalSize;
+    uint64_t compressedSize;
+    uint64_t offset;            // Start of the entry's compressed stream
+    int64_t modifiedTime;       // Seconds since the Unix epoch
+};
+
+// Multi-file archive: "FZAR" and a version byte, then one complete block
+// stream per entry, then a central directory sorted by name:
+// [uint16 name length][name][uint64 original size][uint64 compressed size]
+// [uint64 offset][int64 mtime] per entry, ending with
+// [uint64 directory offset][uint64 entry count]["FZCD"]
+class FileArchive {
+private:
+    ParallelEngine engine;
+
+    // Files up to this many blocks are compressed whole on one worker, several
+    // at a time; larger ones use the block-parallel engine directly
+    static const size_t SMALL_FILE_BLOCKS = 4;
+
+    static int64_t toUnixTime(fs::file_time_type time) {
+        auto systemTime = chrono::round<chrono::seconds>(
+            time - fs::file_time_type::clock::now() + chrono::system_clock::now());
+        return systemTime.time_since_epoch().count();
+    }
+
+    static fs::file_time_type fromUnixTime(int64_t seconds) {
+        chrono::system_clock::time_point systemTime{ chrono::seconds(seconds) };
+        return chrono::time_point_cast<fs::file_time_type::duration>(
+            systemTime - chrono::system_clock::now() + fs::file_time_type::clock::now());
+    }
+
+    // Reject names that would escape the extraction directory
+    static bool isSafeName(const string& name);
+
+    // Helper function to write the central directory and trailer
+    static bool writeDirectory(ostream& out, const vector<ArchiveEntry>& entries);
+
+public:
+    explicit FileArchive(int threads = 0) : engine(threads) {}
+
+    void setThreadCount(int threads) {
+        engine.setThreadCount(threads);
+    }
+
+    bool setBlockSize(size_t size) {
+        return engine.setBlockSize(size);
+    }
+
+    void setSampledHistogram(bool enabled) {
+        engine.setSampledHistogram(enabled);
+    }
+
+    bool setLevel(int value) {
+        return engine.setLevel(value);
+    }
+
+    bool setEntropyCodec(int id) {
+        return engine.setEntropyCodec(id);
+    }
+
+    bool setStaticTable(int table) {
+        return engine.setStaticTable(table);
+    }
+
+    // Compress every regular file under directory, except the archive itself,
+    // into one archive. Fails if a relative path is longer than 65535 bytes.
+    bool create(const string& directory, const string& archivePath);
+
+    // Read the central directory from the end of an archive
+    static bool list(const string& archivePath, vector<ArchiveEntry>& entries);
+
+    // Extract one entry by name
+    bool extract(const string& archivePath, const string& name, const string& outputPath);
+
+    // Extract every entry below outputDirectory
+    bool extractAll(const string& archivePath, const string& outputDirectory);
+
+    bool extractEntry(const string& archivePath, const ArchiveEntry& entry, const string& outputPath);
+
+    // Check every entry's checksums, reporting each entry that fails
+    bool verify(const string& archivePath, bool fullDecode);
+};
+
+enum HistoryOperation {
+    HISTORY_COMPRESS,
+    HISTORY_DECOMPRESS
+};
+
+// One finished job in the history store. Paths are absolute; modification
+// times are file clock ticks, compared only for equality.
+struct HistoryRecord {
+    HistoryOperation operation;
+    string inputPath;
+    string outputPath;
+    uint64_t inputSize;
+    int64_t inputModified;
+    uint64_t contentHash;       // xxHash64 of the input; 0 for decompress records
+    uint64_t outputSize;
+    int64_t outputModified;
+    uint64_t settings;          // ParallelEngine::getSettingsKey() of the run
+    int64_t time;               // Seconds since the Unix epoch
+};
+
+// Append-only binary history of compress/decompress runs, used to skip
+// inputs that already have an up-to-date compressed output. The file is
+// "FZHS" and a version byte, then records of
+// [uint32 payload size][payload][uint32 CRC32C of payload], where the payload is
+// [uint8 operation][uint64 content hash][uint64 input size][int64 input mtime]
+// [uint64 output size][int64 output mtime][uint64 settings][int64 time]
+// [uint16 length][input path][uint16 length][output path].
+// A torn record left by a crash is cut off when the store is next opened.
+// Records are kept in memory with sorted indexes by path hash, by content
+// hash and by input size and settings, so lookups are O(log n) over millions
+// of records.
+// All methods are thread-safe.
+class HistoryStore {
+private:
+    // Sorted (key, record number) pairs. New pairs go into a small sorted run
+    // that is merged into the main run once it outgrows about sqrt(n), so
+    // appends stay cheap while lookups remain two binary searches.
+    class KeyIndex {
+    private:
+        struct Entry {
+            uint64_t key;
+            uint32_t record;
+
+            bool operator<(const Entry& other) const {
+                return key < other.key || (key == other.key && record < other.record);
+            }
+        };
+
+        vector<Entry> sorted;
+        vector<Entry> recent;
+
+    public:
+        void clear() {
+            sorted.clear();
+            recent.clear();
+        }
+
+        // Bulk add while loading; call finishLoading before any lookup
+        void load(uint64_t key, uint32_t record) {
+            sorted.push_back(Entry{ key, record });
+        }
+
+        void finishLoading() {
+            sort(sorted.begin(), sorted.end());
+        }
+
+        void insert(uint64_t key, uint32_t record);
+
+        // Record numbers stored under key, newest first
+        void find(uint64_t key, vector<uint32_t>& result) const;
+    };
+
+    vector<HistoryRecord> records;
+    KeyIndex pathIndex;
+    KeyIndex contentIndex;
+    KeyIndex sizeIndex;
+    ofstream log;
+    string logPath;
+    mutable mutex storeLock;
+
+    static uint64_t pathKey(const string& path) {
+        return xxHash64(reinterpret_cast<const unsigned char*>(path.data()), path.size());
+    }
+
+    static uint64_t sizeKey(uint64_t inputSize, uint64_t settings) {
+        uint64_t key[2] = { inputSize, settings };
+        return xxHash64(reinterpret_cast<const unsigned char*>(key), sizeof(key));
+    }
+
+    // Helper function to get a file's size and modification time
+    static bool statFile(const string& path, uint64_t& size, int64_t& modified);
+
+    // True if a record's output is still the file it wrote
+    static bool outputIntact(const HistoryRecord& record);
+
+    // Helper function to add a record to memory and the indexes; call with storeLock held
+    void addRecord(const HistoryRecord& record);
+
+    // Helper function to append a record to the file and memory; call with storeLock held
+    bool appendRecord(const HistoryRecord& record);
+
+public:
+    HistoryStore() {}
+
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    // Load a store, creating it if missing
+    bool open(const string& path);
+
+    size_t size() const;
+
+    static string normalizePath(const string& path);
+
+    // xxHash64 of a file's contents
+    static bool hashFile(const string& path, uint64_t& hash);
+
+    // Every record for an input path, newest first
+    vector<HistoryRecord> findByPath(const string& inputPath) const;
+
+    // Every compress record of this content, newest first
+    vector<HistoryRecord> findByContent(uint64_t contentHash) const;
+
+    // Before compressing inputFile to outputFile with the given settings:
+    // true if outputFile is already up to date, because a record matches the
+    // input's path, size and mtime and its output is intact, or because the
+    // input hashes to content that was compressed before, in which case that
+    // output is copied when it lives elsewhere. The input is hashed only when
+    // an earlier compression had the same input size and settings. Otherwise
+    // fills record with the input's details for recordCompressed; a zero
+    // contentHash means the compression should compute it.
+    bool reuseCompressed(const string& inputFile, const string& outputFile, uint64_t settings,
+                         HistoryRecord& record);
+
+    // Record a successful compression prepared by reuseCompressed, with its
+    // contentHash filled in
+    bool recordCompressed(HistoryRecord& record);
+
+    bool recordDecompressed(const string& inputFile, const string& outputFile);
+};
+
+enum JobType {
+    JOB_COMPRESS,
+    JOB_DECOMPRESS,
+    JOB_VERIFY,         // Frame checksums only; verify jobs take no output
+    JOB_VERIFY_FULL     // Decode every block and check the uncompressed data
+};
+
+enum JobState {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED
+};
+
+// Snapshot of one job, safe to keep after the queue moves on
+struct JobStatus {
+    int id;
+    JobType type;
+    JobState state;
+    string input;
+    string output;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t totalBytes;        // Input file size; progress is bytesIn / totalBytes
+    double elapsedSeconds;
+    double mbps;                // Input throughput so far
+    double etaSeconds;          // -1 until there is a rate to estimate from
+    bool reused;                // Compress job skipped: the history store had an up-to-date output
+
+    bool finished() const {
+        return state == JOB_DONE || state == JOB_FAILED || state == JOB_CANCELLED;
+    }
+};
+
+// Background compress/decompress jobs. Jobs run in submission order on a
+// fixed number of runner threads, each with its own copy of the engine
+// settings taken at submit time. Status can be polled from any thread (the
+// GUI does so once per frame) or pushed through a progress callback.
+// Cancelled or failed jobs remove their partial output. With a history store,
+// finished jobs are recorded and compress jobs whose output is already up to
+// date are skipped.
+class JobQueue {
+private:
+    struct Job {
+        JobStatus status;
+        ParallelEngine engine;
+        JobProgress progress;
+        chrono::steady_clock::time_point started;
+    };
+
+    ParallelEngine settings;
+    HistoryStore* history;
+    function<void(const JobStatus&)> callback;
+    vector<unique_ptr<Job>> jobs;           // Indexed by id - 1
+    deque<int> pending;
+    vector<thread> runners;
+    mutex jobLock;
+    condition_variable changed;
+    bool stopping;
+
+    // Helper function to copy a job's status with current counters and rates
+    static JobStatus snapshot(const Job& job);
+
+    void runnerLoop();
+
+    Job* findJob(int id) {
+        return (id >= 1 && size_t(id) <= jobs.size()) ? jobs[id - 1].get() : NULL;
+    }
+
+public:
+    explicit JobQueue(int concurrency = 1);
+
+    // Cancels everything still queued or running, then joins the runners
+    ~JobQueue();
+
+    JobQueue(const JobQueue&) = delete;
+    JobQueue& operator=(const JobQueue&) = delete;
+
+    // Settings copied into each job at submit time
+    ParallelEngine& getSettings() {
+        return settings;
+    }
+
+    // Caller-owned store to record jobs in and skip unchanged inputs with;
+    // NULL disables both. Set before submitting.
+    void setHistory(HistoryStore* store) {
+        history = store;
+    }
+
+    // Called on a runner thread after every block and when a job finishes;
+    // set before submitting
+    void setProgressCallback(function<void(const JobStatus&)> onProgress) {
+        callback = move(onProgress);
+    }
+
+    // Queue a job and return its id
+    int submit(JobType type, const string& input, const string& output);
+
+    bool getStatus(int id, JobStatus& status);
+
+    vector<JobStatus> getAll();
+
+    // Drop a queued job, or stop a running one at its next block boundary
+    bool cancel(int id);
+
+    void cancelAll();
+
+    // Stage timings of a finished job; false if it is unknown or still running
+    bool getStats(int id, RunStats& stats);
+
+    // Block until the job finishes and return its final status; unknown ids
+    // report JOB_FAILED
+    JobStatus wait(int id);
+
+    void waitAll();
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef FILEZIPPER_TABLES_H
+#define FILEZIPPER_TABLES_H
+
+// Pretrained Huffman code lengths for small inputs, selected with
+// --table=<name>. Streams refer to a table by its position in STATIC_TABLES,
+// so entries may be appended but never reordered or removed.
+//
+// Each table has one slot per symbol stream: raw bytes (level 0), then the
+// LZ literals, literal length, match length and offset codes. A slot is one
+// hex digit per symbol giving its code length; symbols past the end of the
+// string have no code. Regenerate a table with
+//   FileZipper --train-table <name> <file or directory>... [--level=<1-9>]
+
+const int STATIC_SLOT_COUNT = 5;
+
+struct StaticTable {
+    const char* name;
+    const char* lengths[STATIC_SLOT_COUNT];
+};
+
+const StaticTable STATIC_TABLES[] = {
+    { "json", {
+        "EFFFFFFFFA5FF7FFFFFFFFFFFFFFFFFF3F4FFBFFFFBA575676777778886FFAFFB9A999AAA9AAA99A9A989AAAAAA9F9A7D5766477658866556A5556888798F8FFAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAFFFCFFFFFFFFFFFFBCFFFFFFFFFFFFFFBFBBA88888FBBCFCBFFFFFFFFFFFFFFF",
+        "EFFFFFFFFF9FFFFFFFFFFFFFFFFFFFFF6F7BFBBFBFA9976766677777778FFABFA88888898899888889888898999ABAA9B566656775886666686556778789D9CF8888888888888888888888888888888888888888888888888888888888888888FFFBCCFFFFFFFFFFBCFFFFFFFFFFFFFFCFAA866666B99AFAAFFFFFFFFFFFFFFF",
+        "1344555566777888567A9DEEFFFEFEFFFFFFFFFFEEFF",
+        "333444455666768734579ACEEEFFFFFFFFFFFFFFFFFF",
+        "EEEEC999888888884333334445567AEEFFFFFFFFFFFF" } },
+    { "logs", {
+        "EEEEEEEFFF6FF8FFFFFFFFFFFFFFFFFF4FFFFFFF88F8855754476667885F9F9F9FFFFFFFFFFFFFFFBFFAFAFFFFFFFFA9F4655466759755565F65557A879FFFAFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF",
+        "EEEEEEEEEE6EEBEEEEEEEEEEEEEEEEEE6E9EEAEC9BA8C55754455556667EDCBE8DEBABECECECDDCBDECBADEEEECEEE97E56664667588555559555678778EEE9EEEEEEEDEEEEEEEEEEEDEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEEDEEEEEEEEEEEEEEEEEEEEEEEEEEEEE",
+        "133445666788888978BBDCCDDCCDDDCCDDCCCCCCCCCC",
+        "4445555554466557326CC9CCCCCCCCCCCCCCCCCCCCCC",
+        "EEEEADCBBBCBABCB7433443334456AEEEEEEEEEEEEEE" } },
+    { "text", {
+        "EFFFFFFFFF5FFFFFFFFFFFFFFFFFFFFF3F97FFF9888F866678899999997B999FF8A9989AA8FF99999F888AFAFAF8A8F865655466659856546A44467787AAAAFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF",
+        "EEFFFFFFFF5FFFFFFFFFFFFFFFFFFFFF4A88FFF8778F776777777778887AA99AF798889997FD88888F8789A9BAF8A8F76465546664A856556A54557786AAA9FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF",
+        "134445556677778967ACFFFFFFFFFFFFFFFFFFFFFFFF",
+        "23344445566667774589ACEEFFFFFFFFFFFFFFFFFFFF",
+        "E9EEECBAAA9AAA99544433333446BEFFFFFFFFFFFFFF" } },
+};
+
+const int STATIC_TABLE_COUNT = int(sizeof(STATIC_TABLES) / sizeof(STATIC_TABLES[0]));
+
+#endif